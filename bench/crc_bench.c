@@ -0,0 +1,97 @@
+/**
+ * @file crc_bench.c
+ * @brief Host benchmark of the built-in CRC-16/MODBUS implementations
+ *
+ * Built once per RSCP_CRC_IMPL value by the Makefile in this directory. Each
+ * build times rscpCrc16 over a few buffer sizes and prints the cost per byte,
+ * in TSC cycles on x86 and in nanoseconds everywhere.
+ *
+ * @author MickySim: https://www.mickysim.com
+ * @date 2023
+ * @copyright
+ * Copyright (c) 2023 MickySim All rights reserved.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC                         (1)
+#else
+#define BENCH_HAS_TSC                         (0)
+#endif
+
+#include "lib/rscpProtocol.h"
+
+#define BENCH_BUFFER_SIZE                     (4096)
+#define BENCH_BYTES_PER_SIZE                  (16UL * 1024 * 1024)  // Bytes hashed per buffer size
+#define BENCH_REPEATS                         (5)                   // Best of, to filter out noise
+
+static const char *benchImplName[] = { "CALLBACK", "BITWISE", "NIBBLE", "TABLE", "SLICE_BY_8" };
+
+static const uint32_t benchSizes[] = { 8, 32, 166, BENCH_BUFFER_SIZE }; // Short frame, AVR frame, largest frame
+
+static uint8_t benchBuffer[BENCH_BUFFER_SIZE];
+static volatile uint16_t benchSink; // Keeps the CRC from being optimised away
+
+static uint64_t benchNowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+int main(void) {
+    uint32_t seed = 0x12345678;
+
+    for (uint32_t i = 0; i < sizeof(benchBuffer); i++) {
+        seed = seed * 1103515245 + 12345;
+        benchBuffer[i] = (uint8_t)(seed >> 16);
+    }
+
+    // Check value of CRC-16/MODBUS
+    if (rscpCrc16((const uint8_t *)"123456789", 9) != 0x4B37) {
+        printf("%s: wrong check value\n", benchImplName[RSCP_CRC_IMPL]);
+        return 1;
+    }
+
+    for (uint32_t s = 0; s < sizeof(benchSizes) / sizeof(benchSizes[0]); s++) {
+        uint32_t size = benchSizes[s];
+        uint32_t loops = BENCH_BYTES_PER_SIZE / size;
+        double bestNs = 0;
+        double bestCycles = 0;
+
+        for (uint32_t r = 0; r < BENCH_REPEATS; r++) {
+            uint64_t startNs = benchNowNs();
+#if BENCH_HAS_TSC
+            uint64_t startCycles = __rdtsc();
+#endif
+            uint16_t crc = 0;
+            for (uint32_t i = 0; i < loops; i++) {
+                // Each CRC feeds the next one, as frames are checked one after another
+                benchBuffer[0] = (uint8_t)crc;
+                crc = rscpCrc16(benchBuffer, size);
+            }
+            benchSink = crc;
+#if BENCH_HAS_TSC
+            double cycles = (double)(__rdtsc() - startCycles) / ((double)loops * size);
+#else
+            double cycles = 0;
+#endif
+            double ns = (double)(benchNowNs() - startNs) / ((double)loops * size);
+
+            if ((r == 0) || (ns < bestNs)) {
+                bestNs = ns;
+                bestCycles = cycles;
+            }
+        }
+
+        printf("%-10s %5lu bytes: %6.2f cycles/byte %6.3f ns/byte\n", benchImplName[RSCP_CRC_IMPL],
+               (unsigned long)size, bestCycles, bestNs);
+    }
+
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _RSCP_PROTOCOL_CALLBACKS_H_
+#define _RSCP_PROTOCOL_CALLBACKS_H_
+
+// The benchmark only calls the CRC engine, the transport is never used
+
+static inline int32_t rscpGetRxByteCallback(uint8_t *byte) {
+    (void)byte;
+    return -1;
+}
+
+static inline void rscpRxWaitingCallback(void) {
+}
+
+static inline int32_t rscpSendSlotCallback(const uint8_t *buffer, uint32_t length) {
+    (void)buffer;
+    (void)length;
+    return -1;
+}
+
+static inline int32_t rscpRequestSlotCallback(uint32_t length) {
+    (void)length;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef _RSCP_PROTOCOL_CONFIG_H_
+#define _RSCP_PROTOCOL_CONFIG_H_
+
+// Benchmark build: a master with the CRC implementation chosen by the Makefile
+#define RSCP_DEVICE_IS_MASTER                                                (1)
+
+#endif
@@ -14,281 +14,3627 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "rscpProtocol.h"
 
 #include "../moduleConfigs/rscpProtocolCallbacks.h"
 
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#endif
+
 //---[ Macros ]-----------------------------------------------------------------
 
-//---[ Constants ]--------------------------------------------------------------
+#if RSCP_CRC_IMPL == RSCP_CRC_IMPL_CALLBACK
+#define rscpGetCrc(data, length)              rscpGetCrcCallback((data), (length))
+#else
+#define rscpGetCrc(data, length)              rscpCrc16((data), (length))
+#endif
+
+#if RSCP_USE_TIME_CALLBACK
+#define rscpNow()                             rscpGetTimeCallback()
+#define rscpTimeReached(deadline)             ((int32_t)(rscpNow() - (deadline)) >= 0) // Wrap safe
+#endif
+
+// Source of the state reported by the GET commands
+#if RSCP_ENABLE_STATE_STORE
+#define rscpLoadState(field, reply)           do { struct RSCP_state state_; rscpReadState(&state_); *(reply) = state_.field; } while (0)
+#define rscpLoadShutterPosition(reply)        rscpLoadState(shutter, (reply))
+#define rscpLoadSwitchRelay(reply)            rscpLoadState(relay, (reply))
+#define rscpLoadSwitchButton(reply)           rscpLoadState(button, (reply))
+#else
+#define rscpLoadShutterPosition(reply)        rscpGetShutterPositionCallback((reply))
+#define rscpLoadSwitchRelay(reply)            rscpGetSwitchRelayCallback((reply))
+#define rscpLoadSwitchButton(reply)           rscpGetSwitchButtonCallback((reply))
+#endif
+
+// Buffers a call receives, builds and sends frames with, static or locals. In
+// the arena a received frame is read where the parser assembled it, and a
+// reply is filled in at the data offset of the frame that will carry it.
+#if RSCP_ENABLE_STATIC_ARENA
+#define rscpDeclareFrame(name)                struct RSCP_frame *name = &rscpRxParser.frame
+#define rscpDeclareTxBuffer(name)             uint8_t *name = rscpArenaTx
+#define rscpDeclareReply(name, size)          uint8_t *name = &rscpArenaTx[RSCP_TX_DATA_OFFSET]
+#else
+#define rscpDeclareFrame(name)                struct RSCP_frame name##Local_; struct RSCP_frame *name = &name##Local_
+#define rscpDeclareTxBuffer(name)             uint8_t name[RSCP_MAX_TX_BUFFER_SIZE]
+#define rscpDeclareReply(name, size)          uint8_t name[size]
+#endif
+
+// Index of the data in a frame with the longest header
+#define RSCP_TX_DATA_OFFSET                   (3 + RSCP_ENABLE_SEQUENCE)
+
+// Reply type of the built-in actions
+#if RSCP_ENABLE_JOB_QUEUE
+#define RSCP_REPLY_ACTION                     RSCP_REPLY_JOB
+#else
+#define RSCP_REPLY_ACTION                     RSCP_REPLY_STATUS
+#endif
+
+// Transactions the master can have waiting for a reply at the same time
+#if RSCP_ENABLE_SEQUENCE
+#define RSCP_ASYNC_SLOTS                      RSCP_MAX_IN_FLIGHT
+#else
+#define RSCP_ASYNC_SLOTS                      (1)
+#endif
+
+#if defined(__AVR__)
+#define RSCP_PROGMEM                          PROGMEM
+#define rscpReadTableWord(address)            pgm_read_word(address)
+#define rscpReadTableEntry(entry, address)    memcpy_P((entry), (address), sizeof(*(entry)))
+#else
+#define RSCP_PROGMEM
+#define rscpReadTableWord(address)            (*(address))
+#define rscpReadTableEntry(entry, address)    memcpy((entry), (address), sizeof(*(entry)))
+#endif
+
+// Compile-time CRC table generators. One step shifts one bit through the
+// reflected polynomial, so RSCP_CRC16_STEP8(n) is the table entry for byte n.
+#define RSCP_CRC16_STEP(c)                    (((c) >> 1) ^ (((c) & 1) ? RSCP_CRC16_POLY : 0))
+#define RSCP_CRC16_STEP2(c)                   RSCP_CRC16_STEP(RSCP_CRC16_STEP(c))
+#define RSCP_CRC16_STEP4(c)                   RSCP_CRC16_STEP2(RSCP_CRC16_STEP2(c))
+#define RSCP_CRC16_STEP8(c)                   RSCP_CRC16_STEP4(RSCP_CRC16_STEP4(c))
+
+// Expand ENTRY(arg, index) for the 16 or 256 literal indexes of a table
+#define RSCP_CRC16_ROW16(ENTRY, arg, hi) \
+    ENTRY(arg, 0x##hi##0), ENTRY(arg, 0x##hi##1), ENTRY(arg, 0x##hi##2), ENTRY(arg, 0x##hi##3), \
+    ENTRY(arg, 0x##hi##4), ENTRY(arg, 0x##hi##5), ENTRY(arg, 0x##hi##6), ENTRY(arg, 0x##hi##7), \
+    ENTRY(arg, 0x##hi##8), ENTRY(arg, 0x##hi##9), ENTRY(arg, 0x##hi##A), ENTRY(arg, 0x##hi##B), \
+    ENTRY(arg, 0x##hi##C), ENTRY(arg, 0x##hi##D), ENTRY(arg, 0x##hi##E), ENTRY(arg, 0x##hi##F)
+#define RSCP_CRC16_ROW256(ENTRY, arg) \
+    RSCP_CRC16_ROW16(ENTRY, arg, 0), RSCP_CRC16_ROW16(ENTRY, arg, 1), RSCP_CRC16_ROW16(ENTRY, arg, 2), \
+    RSCP_CRC16_ROW16(ENTRY, arg, 3), RSCP_CRC16_ROW16(ENTRY, arg, 4), RSCP_CRC16_ROW16(ENTRY, arg, 5), \
+    RSCP_CRC16_ROW16(ENTRY, arg, 6), RSCP_CRC16_ROW16(ENTRY, arg, 7), RSCP_CRC16_ROW16(ENTRY, arg, 8), \
+    RSCP_CRC16_ROW16(ENTRY, arg, 9), RSCP_CRC16_ROW16(ENTRY, arg, A), RSCP_CRC16_ROW16(ENTRY, arg, B), \
+    RSCP_CRC16_ROW16(ENTRY, arg, C), RSCP_CRC16_ROW16(ENTRY, arg, D), RSCP_CRC16_ROW16(ENTRY, arg, E), \
+    RSCP_CRC16_ROW16(ENTRY, arg, F)
+
+#define RSCP_CRC16_NIBBLE_ENTRY(unused, n)    RSCP_CRC16_STEP4(n)
+#define RSCP_CRC16_BYTE_ENTRY(unused, n)      RSCP_CRC16_STEP8(n)
+
+#if RSCP_CRC_IMPL == RSCP_CRC_IMPL_SLICE_BY_8
+// Slice k holds the CRC of byte n followed by k zero bytes. It is linear in n,
+// so each entry is the XOR of the basis values of the bits set in n.
+#define RSCP_CRC16_SPREAD(k, n) \
+    ((((n) & 0x01) ? RSCP_CRC16_B##k##_0 : 0) ^ (((n) & 0x02) ? RSCP_CRC16_B##k##_1 : 0) ^ \
+     (((n) & 0x04) ? RSCP_CRC16_B##k##_2 : 0) ^ (((n) & 0x08) ? RSCP_CRC16_B##k##_3 : 0) ^ \
+     (((n) & 0x10) ? RSCP_CRC16_B##k##_4 : 0) ^ (((n) & 0x20) ? RSCP_CRC16_B##k##_5 : 0) ^ \
+     (((n) & 0x40) ? RSCP_CRC16_B##k##_6 : 0) ^ (((n) & 0x80) ? RSCP_CRC16_B##k##_7 : 0))
+#define RSCP_CRC16_SHIFT8(c)                  (((c) >> 8) ^ RSCP_CRC16_SPREAD(0, (c) & 0xFF))
+#define RSCP_CRC16_BASIS(k, prev) \
+    RSCP_CRC16_B##k##_0 = RSCP_CRC16_SHIFT8(RSCP_CRC16_B##prev##_0), \
+    RSCP_CRC16_B##k##_1 = RSCP_CRC16_SHIFT8(RSCP_CRC16_B##prev##_1), \
+    RSCP_CRC16_B##k##_2 = RSCP_CRC16_SHIFT8(RSCP_CRC16_B##prev##_2), \
+    RSCP_CRC16_B##k##_3 = RSCP_CRC16_SHIFT8(RSCP_CRC16_B##prev##_3), \
+    RSCP_CRC16_B##k##_4 = RSCP_CRC16_SHIFT8(RSCP_CRC16_B##prev##_4), \
+    RSCP_CRC16_B##k##_5 = RSCP_CRC16_SHIFT8(RSCP_CRC16_B##prev##_5), \
+    RSCP_CRC16_B##k##_6 = RSCP_CRC16_SHIFT8(RSCP_CRC16_B##prev##_6), \
+    RSCP_CRC16_B##k##_7 = RSCP_CRC16_SHIFT8(RSCP_CRC16_B##prev##_7)
+#define RSCP_CRC16_SLICE_ENTRY(k, n)          RSCP_CRC16_SPREAD(k, n)
+#endif
+
+//---[ Constants ]--------------------------------------------------------------
+
+#if RSCP_CRC_IMPL == RSCP_CRC_IMPL_NIBBLE
+
+static const uint16_t rscpCrc16NibbleTable[16] RSCP_PROGMEM = {
+    RSCP_CRC16_ROW16(RSCP_CRC16_NIBBLE_ENTRY, 0, )
+};
+
+#elif RSCP_CRC_IMPL == RSCP_CRC_IMPL_TABLE
+
+static const uint16_t rscpCrc16Table[256] RSCP_PROGMEM = {
+    RSCP_CRC16_ROW256(RSCP_CRC16_BYTE_ENTRY, 0)
+};
+
+#elif RSCP_CRC_IMPL == RSCP_CRC_IMPL_SLICE_BY_8
+
+enum {
+    RSCP_CRC16_B0_0 = RSCP_CRC16_STEP8(0x01), RSCP_CRC16_B0_1 = RSCP_CRC16_STEP8(0x02),
+    RSCP_CRC16_B0_2 = RSCP_CRC16_STEP8(0x04), RSCP_CRC16_B0_3 = RSCP_CRC16_STEP8(0x08),
+    RSCP_CRC16_B0_4 = RSCP_CRC16_STEP8(0x10), RSCP_CRC16_B0_5 = RSCP_CRC16_STEP8(0x20),
+    RSCP_CRC16_B0_6 = RSCP_CRC16_STEP8(0x40), RSCP_CRC16_B0_7 = RSCP_CRC16_STEP8(0x80),
+    RSCP_CRC16_BASIS(1, 0), RSCP_CRC16_BASIS(2, 1), RSCP_CRC16_BASIS(3, 2), RSCP_CRC16_BASIS(4, 3),
+    RSCP_CRC16_BASIS(5, 4), RSCP_CRC16_BASIS(6, 5), RSCP_CRC16_BASIS(7, 6),
+};
+
+static const uint16_t rscpCrc16Slices[8][256] = {
+    { RSCP_CRC16_ROW256(RSCP_CRC16_SLICE_ENTRY, 0) },
+    { RSCP_CRC16_ROW256(RSCP_CRC16_SLICE_ENTRY, 1) },
+    { RSCP_CRC16_ROW256(RSCP_CRC16_SLICE_ENTRY, 2) },
+    { RSCP_CRC16_ROW256(RSCP_CRC16_SLICE_ENTRY, 3) },
+    { RSCP_CRC16_ROW256(RSCP_CRC16_SLICE_ENTRY, 4) },
+    { RSCP_CRC16_ROW256(RSCP_CRC16_SLICE_ENTRY, 5) },
+    { RSCP_CRC16_ROW256(RSCP_CRC16_SLICE_ENTRY, 6) },
+    { RSCP_CRC16_ROW256(RSCP_CRC16_SLICE_ENTRY, 7) },
+};
+
+#endif
+
+//---[ Types ]------------------------------------------------------------------
+
+typedef enum {
+    RSCP_RX_STATE_LENGTH = 0,   // Skipping preamble bytes, waiting for length byte
+    RSCP_RX_STATE_COMMAND,
+    RSCP_RX_STATE_DATA,
+    RSCP_RX_STATE_CRC_HIGH,
+    RSCP_RX_STATE_CRC_LOW,
+    RSCP_RX_STATE_PREAMBLE,     // Resync mode only: waiting for a preamble byte
+    RSCP_RX_STATE_SEQUENCE,     // Sequence mode only: waiting for the sequence byte
+} RSCP_RxState;
+
+#if RSCP_DEVICE_IS_MASTER
+
+typedef enum {
+    RSCP_ASYNC_STATE_IDLE = 0,
+    RSCP_ASYNC_STATE_SEND,      // Request not sent yet
+    RSCP_ASYNC_STATE_RECEIVE,   // Waiting for the reply
+} RSCP_AsyncState;
+
+struct RSCP_transaction
+{
+    uint8_t state;
+    uint8_t priority;           // RSCP_PRIORITY_*
+    uint8_t command;
+    uint8_t dataLength;
+    uint8_t data[RSCP_MAX_DATA_LENGTH];
+    uint8_t *reply;             // NULL for actions
+    uint8_t replyLength;
+    uint32_t timeout_ticks;
+#if RSCP_USE_TIME_CALLBACK
+    uint32_t deadline;          // rscpNow() value the whole transaction must end by
+    uint32_t attemptDeadline;   // rscpNow() value the current attempt times out at
+    uint32_t sentAt;            // rscpNow() value the current attempt was sent at
+#else
+    uint32_t ticks;             // Ticks left before timing out
+#endif
+    RSCP_CompletionCallback callback;
+    void *context;
+#if RSCP_ENABLE_MULTI_SLAVE
+    struct RSCP_slave *slave;   // NULL for the currently selected slave
+#endif
+#if RSCP_ENABLE_SEQUENCE
+    int16_t sequence;           // Stamped when sent, RSCP_NO_SEQUENCE if unsequenced
+#endif
+    uint8_t attempts;           // Retries made so far
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+    struct RSCP_rtt *rtt;       // Estimate of the command on the target slave
+#if !RSCP_USE_TIME_CALLBACK
+    uint32_t elapsed;           // Ticks since the request was sent
+#endif
+#endif
+};
+
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_FRAGMENTATION
+
+// Reassembly state of the transfer being received
+struct RSCP_fragment_rx
+{
+    uint8_t transfer;
+    uint8_t chunkSize;          // Every fragment of the transfer must use the same
+    bool started;
+    bool complete;              // rscpFragmentCompleteCallback was called
+    uint16_t base;              // All fragments below this index were received
+    uint8_t bitmap;             // Bit i set if fragment base + i was received
+    int32_t last;               // Index of the last fragment, -1 until it arrives
+    uint32_t length;            // Total length, valid once last is known
+    RSCP_ErrorType error;       // Write error to report with the next ack
+};
+
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_JOB_QUEUE
+
+// Deferred action, kept after it ran so its result can be read
+struct RSCP_job
+{
+    uint8_t id;
+    uint8_t state;              // RSCP_DEF_JOB_STATE_*
+    uint8_t result;             // RSCP_ErrorType once done
+    uint8_t dataLength;
+    RSCP_CommandHandler handler;
+    uint8_t data[RSCP_MAX_DATA_LENGTH];
+};
+
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_REPLY_CACHE
+
+// Wire size of the largest cached reply, which is the shutter position
+#define RSCP_REPLY_CACHE_FRAME_SIZE           (1 + 2 + sizeof(struct RSCP_Reply_rollershutterposition) + 2)
+
+// Ready-to-send reply of one GET command. Double buffered, so the frame last
+// handed out stays intact while the next one is built.
+struct RSCP_reply_cache
+{
+    volatile uint8_t active;    // Buffer served to the master
+    uint8_t length[2];          // Frame length, 0 until first refreshed
+    uint8_t frame[2][RSCP_REPLY_CACHE_FRAME_SIZE];
+#if RSCP_ENABLE_SEQUENCE
+    uint8_t sequenced[2][RSCP_REPLY_CACHE_FRAME_SIZE + 1]; // Same reply with a sequence byte, patched per request
+#endif
+};
+
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_REPLAY_CACHE
+
+// Wire size of the largest cached reply, the results of a full batch
+#define RSCP_REPLAY_FRAME_SIZE                (1 + 2 + 1 + RSCP_MAX_DATA_LENGTH / RSCP_DEF_BATCH_HEADER_SIZE + 2)
+
+// Reply sent to an action, kept to answer its retries
+struct RSCP_replay
+{
+    bool valid;
+    uint8_t sequence;
+    uint8_t command;
+    uint16_t crc;               // CRC of the request
+    uint8_t length;             // Length of the reply frame, 0 if it did not fit
+    uint8_t frame[RSCP_REPLAY_FRAME_SIZE];
+};
+
+#endif
+
+#if RSCP_ENABLE_RESYNC
+#define RSCP_RX_STATE_IDLE                    RSCP_RX_STATE_PREAMBLE
+#else
+#define RSCP_RX_STATE_IDLE                    RSCP_RX_STATE_LENGTH
+#endif
+
+//---[ Private Variables ]------------------------------------------------------
+
+static struct RSCP_parser rscpRxParser;
+
+#if RSCP_ENABLE_STATIC_ARENA
+static uint8_t rscpArenaTx[RSCP_MAX_TX_BUFFER_SIZE]; // Frame being sent, received frames stay in rscpRxParser
+#endif
+
+#if RSCP_ENABLE_SEQUENCE
+static int16_t rscpTxSequence = RSCP_NO_SEQUENCE;  // Stamped on the frames sent by rscpSendMsg
+#endif
+
+#if RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_SEQUENCE
+static uint8_t rscpNextSequence;
+#endif
+
+#if RSCP_DEVICE_IS_MASTER
+static struct RSCP_transaction rscpAsync[RSCP_ASYNC_SLOTS]; // Sent, waiting for their reply
+static struct RSCP_transaction rscpQueue[RSCP_TRANSACTION_QUEUE_SIZE]; // Pending, highest priority first
+static uint8_t rscpQueueCount;
+#endif
+
+#if RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_MULTI_SLAVE
+static struct RSCP_slave rscpSlaves[RSCP_MAX_SLAVES];
+static uint8_t rscpSlaveCount;
+static uint8_t rscpLastSlaveIndex = RSCP_MAX_SLAVES - 1;  // Slave served last, for round-robin
+static struct RSCP_slave *rscpSelectedSlave;
+#endif
+
+#if RSCP_DEVICE_IS_MASTER
+static uint8_t rscpDefaultDataLength = RSCP_DEF_BASE_DATA_LENGTH;  // Negotiated with the default slave
+static uint8_t rscpDefaultProtocolVersion = RSCP_DEF_PROTOCOL_VERSION_BASE;
+static uint8_t rscpDefaultChangesAck;
+#endif
+
+#if RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_ADAPTIVE_TIMEOUT
+static struct RSCP_rtt rscpRtt[RSCP_RTT_COMMANDS];    // Used when no slave handle is selected
+#endif
+
+#if RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_FRAGMENTATION
+static uint8_t rscpNextTransfer;
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_FRAGMENTATION
+static struct RSCP_fragment_rx rscpFragmentRx;
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_REPLAY_CACHE
+static struct RSCP_replay rscpReplays[RSCP_REPLAY_CACHE_SIZE];
+static uint8_t rscpReplayNext;                  // Entry overwritten next
+static struct RSCP_replay *rscpReplayRecord;    // Entry capturing the reply being sent
+static uint8_t rscpReplayNewest;                // Newest sequence received, polls included
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_STATE_STORE
+static struct RSCP_state rscpStateCopies[2];    // Readers use the copy picked by the sequence
+static volatile uint8_t rscpStateSequence;
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_EVENT_DRIVEN
+static uint8_t rscpStagedReply[RSCP_MAX_TX_BUFFER_SIZE];   // Copy of a reply built in the transmit buffer
+static const uint8_t *rscpStagedFrame = rscpStagedReply;    // Reply waiting for the master to read it
+static volatile uint8_t rscpStagedLength;
+static volatile uint8_t rscpStagedIndex;                    // Bytes of it already read
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_REPLY_CACHE
+static struct RSCP_reply_cache rscpShutterCache;
+static struct RSCP_reply_cache rscpRelayCache;
+static struct RSCP_reply_cache rscpButtonCache;
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_JOB_QUEUE
+static struct RSCP_job rscpJobs[RSCP_JOB_QUEUE_SIZE];   // Ring, oldest first
+static volatile uint8_t rscpJobHead;                    // Next job to run
+static volatile uint8_t rscpJobPending;                 // Also updated by rscpOnReceive
+static uint8_t rscpLastJob = RSCP_DEF_JOB_NONE;
+#endif
+
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_CHANGE_TRACKING
+static uint8_t rscpDirty;          // RSCP_DEF_DIRTY_* bits not acknowledged by the master yet
+static uint8_t rscpDirtyReported;  // Dirty bits sent in the last reply and not changed since
+static struct RSCP_Reply_rollershutterposition rscpLastShutter;
+static struct RSCP_Reply_switchrelay rscpLastRelay;
+static struct RSCP_Reply_switchbutton rscpLastButton;
+#endif
+
+#if RSCP_USE_RX_BYTES_CALLBACK
+static uint8_t rscpRxChunk[RSCP_RX_CHUNK_SIZE];
+static uint8_t rscpRxChunkIndex;
+static uint8_t rscpRxChunkLength;
+#endif
+
+//---[ Public Variables ]-------------------------------------------------------
+
+//---[ Private Functions ]------------------------------------------------------
+
+/**
+ * @brief Accumulates one byte into a streaming CRC.
+ *
+ * Does nothing when the host CRC callback is used, as it only works on
+ * whole buffers.
+ *
+ * @param crc Current CRC accumulator.
+ * @param value Byte to accumulate.
+ * @return Updated CRC accumulator.
+ */
+static inline uint16_t rscpCrc16UpdateByte(uint16_t crc, uint8_t value) {
+#if RSCP_CRC_IMPL == RSCP_CRC_IMPL_CALLBACK
+    (void)value;
+    return crc;
+#else
+    return rscpCrc16Update(crc, &value, 1);
+#endif
+}
+
+/**
+ * @brief Aborts the frame being parsed and records the reason.
+ *
+ * @param parser Pointer to the parser context.
+ * @param error The error to report.
+ * @return Always RSCP_PARSE_ERROR.
+ */
+static RSCP_ParseStatus rscpParserFail(struct RSCP_parser *parser, RSCP_ErrorType error) {
+    parser->error = error;
+    parser->state = RSCP_RX_STATE_IDLE;
+    parser->dataIndex = 0;
+    return RSCP_PARSE_ERROR;
+}
+
+/**
+ * @brief Advances the parser state machine by one received byte.
+ *
+ * @param parser Pointer to the parser context.
+ * @param readByte The received byte.
+ * @return Parse status after consuming the byte.
+ */
+static RSCP_ParseStatus rscpParserStep(struct RSCP_parser *parser, uint8_t readByte) {
+    struct RSCP_frame *frame = &parser->frame;
+
+    switch (parser->state) {
+        case RSCP_RX_STATE_LENGTH:
+            if (readByte != RSCP_PREAMBLE_BYTE) {
+                // Validate the length right away instead of waiting for bytes that never come
+                if (readByte < 2) {
+                    return rscpParserFail(parser, RSCP_ERR_MALFORMED);
+                }
+                if ((uint32_t)(readByte - 2) > sizeof(frame->data) + RSCP_ENABLE_SEQUENCE) {
+                    return rscpParserFail(parser, RSCP_ERR_OVERFLOW);
+                }
+                frame->length = readByte;
+                parser->dataIndex = 0;
+                parser->crc = rscpCrc16UpdateByte(rscpCrc16Init(), readByte);
+                parser->state = RSCP_RX_STATE_COMMAND;
+            }
+            break;
+        case RSCP_RX_STATE_COMMAND:
+            frame->command = readByte;
+            parser->crc = rscpCrc16UpdateByte(parser->crc, readByte);
+#if RSCP_ENABLE_SEQUENCE
+            frame->sequence = RSCP_NO_SEQUENCE;
+            if (readByte & RSCP_CMD_FLAG_SEQUENCE) {
+                if (frame->length < 3) {
+                    return rscpParserFail(parser, RSCP_ERR_MALFORMED);
+                }
+                frame->command = readByte & ~RSCP_CMD_FLAG_SEQUENCE;
+                parser->state = RSCP_RX_STATE_SEQUENCE;
+                break;
+            }
+            if ((uint32_t)(frame->length - 2) > sizeof(frame->data)) {
+                return rscpParserFail(parser, RSCP_ERR_OVERFLOW);
+            }
+#endif
+            if (frame->length > 2) {
+                parser->state = RSCP_RX_STATE_DATA;     // Data bytes will follow, request them
+            } else {
+                parser->state = RSCP_RX_STATE_CRC_HIGH; // No data bytes will follow, go to CRC
+            }
+            break;
+#if RSCP_ENABLE_SEQUENCE
+        case RSCP_RX_STATE_SEQUENCE:
+            frame->sequence = readByte;
+            parser->crc = rscpCrc16UpdateByte(parser->crc, readByte);
+            frame->length--; // From here on the length only counts command and data
+            parser->state = (frame->length > 2) ? RSCP_RX_STATE_DATA : RSCP_RX_STATE_CRC_HIGH;
+            break;
+#endif
+        case RSCP_RX_STATE_DATA:
+            frame->data[parser->dataIndex++] = readByte;
+            parser->crc = rscpCrc16UpdateByte(parser->crc, readByte);
+            if (parser->dataIndex >= (uint32_t)(frame->length - sizeof(frame->crc))) {
+                parser->state = RSCP_RX_STATE_CRC_HIGH;
+            }
+            break;
+        case RSCP_RX_STATE_CRC_HIGH:
+            frame->crc = (readByte << 8);
+            parser->state = RSCP_RX_STATE_CRC_LOW;
+            break;
+        case RSCP_RX_STATE_CRC_LOW:
+            frame->crc |= readByte;
+            parser->state = RSCP_RX_STATE_IDLE;
+#if RSCP_CRC_IMPL == RSCP_CRC_IMPL_CALLBACK
+            // The host CRC cannot be streamed, check the whole frame now
+            parser->crc = rscpGetCrcCallback((uint8_t *)frame, frame->length);
+#endif
+            if (rscpCrc16Final(parser->crc) != frame->crc) {
+                return rscpParserFail(parser, RSCP_ERR_MALFORMED);
+            }
+            return RSCP_PARSE_FRAME_READY;
+        default:
+            return rscpParserFail(parser, RSCP_ERR_MALFORMED);
+    }
+    return RSCP_PARSE_NEED_MORE;
+}
+
+#if RSCP_ENABLE_RESYNC
+
+/**
+ * @brief Restarts parsing at the next preamble found in the window.
+ *
+ * The bytes received after the start of the broken frame (plus any bytes
+ * still waiting to be rescanned) are kept and queued to be parsed again from
+ * the next RSCP_PREAMBLE_BYTE, so a corrupted frame only costs its own bytes.
+ *
+ * @param parser Pointer to the parser context.
+ */
+static void rscpParserResync(struct RSCP_parser *parser) {
+    uint8_t pending = parser->replayLength - parser->replayIndex;
+    uint8_t length = parser->windowLength;
+    uint8_t start = 1;
+
+    memmove(&parser->window[length], &parser->window[parser->replayIndex], pending);
+    length += pending;
+
+    while ((start < length) && (parser->window[start] != RSCP_PREAMBLE_BYTE)) {
+        start++;
+    }
+    if (start < length) {
+        memmove(&parser->window[0], &parser->window[start], length - start);
+        parser->replayLength = length - start;
+    } else {
+        parser->replayLength = 0;
+    }
+    parser->replayIndex = 0;
+    parser->windowLength = 0;
+    parser->state = RSCP_RX_STATE_PREAMBLE;
+}
+
+/**
+ * @brief Records a byte in the resync window and advances the parser.
+ *
+ * Errors are not reported; the parser resynchronises on the next preamble.
+ *
+ * @param parser Pointer to the parser context.
+ * @param readByte The received byte.
+ * @return RSCP_PARSE_NEED_MORE or RSCP_PARSE_FRAME_READY.
+ */
+static RSCP_ParseStatus rscpParserPush(struct RSCP_parser *parser, uint8_t readByte) {
+    RSCP_ParseStatus status;
+
+    if (readByte == RSCP_PREAMBLE_BYTE &&
+        (parser->state == RSCP_RX_STATE_PREAMBLE || parser->state == RSCP_RX_STATE_LENGTH)) {
+        parser->window[0] = readByte;
+        parser->windowLength = 1;
+        parser->state = RSCP_RX_STATE_LENGTH;
+        return RSCP_PARSE_NEED_MORE;
+    }
+    if (parser->state == RSCP_RX_STATE_PREAMBLE) {
+        return RSCP_PARSE_NEED_MORE; // Noise between frames
+    }
+
+    parser->window[parser->windowLength++] = readByte;
+    status = rscpParserStep(parser, readByte);
+    if (status == RSCP_PARSE_ERROR) {
+        rscpParserResync(parser);
+        status = RSCP_PARSE_NEED_MORE;
+    } else if (status == RSCP_PARSE_FRAME_READY) {
+        parser->windowLength = 0;
+    }
+    return status;
+}
+
+#else
+
+#define rscpParserPush(parser, readByte)      rscpParserStep((parser), (readByte))
+
+#endif
+
+#if RSCP_DEVICE_IS_MASTER
+
+/**
+ * @brief Discards any partially received frame and buffered bytes.
+ */
+static void rscpRxReset(void) {
+    rscpParserInit(&rscpRxParser);
+#if RSCP_USE_RX_BYTES_CALLBACK
+    rscpRxChunkIndex = 0;
+    rscpRxChunkLength = 0;
+#endif
+}
+
+#endif
+
+/**
+ * @brief Feeds all bytes that are already available into the receive parser.
+ *
+ * Never waits: it returns as soon as a frame is complete, an error is found
+ * or the host has no more bytes to give.
+ *
+ * @param received Set to true if at least one byte was consumed.
+ * @return Parse status of the receive parser.
+ */
+static RSCP_ParseStatus rscpRxPump(bool *received) {
+    RSCP_ParseStatus status = RSCP_PARSE_NEED_MORE;
+    *received = false;
+
+#if RSCP_USE_RX_BYTES_CALLBACK
+    while (status == RSCP_PARSE_NEED_MORE) {
+        if (rscpRxChunkIndex >= rscpRxChunkLength) {
+            int32_t chunkLength = rscpGetRxBytesCallback(rscpRxChunk, sizeof(rscpRxChunk));
+            if (chunkLength <= 0) {
+                break;
+            }
+            rscpRxChunkIndex = 0;
+            rscpRxChunkLength = (uint8_t)chunkLength;
+        }
+        // Parse straight from the chunk, leftovers stay for the next frame
+        uint32_t consumed;
+        status = rscpParserFeed(&rscpRxParser, &rscpRxChunk[rscpRxChunkIndex],
+                                rscpRxChunkLength - rscpRxChunkIndex, &consumed);
+        rscpRxChunkIndex += consumed;
+        *received = true;
+    }
+#else
+    uint8_t readByte;
+    while ((status == RSCP_PARSE_NEED_MORE) && (rscpGetRxByteCallback(&readByte) >= 0)) {
+        status = rscpParserFeed(&rscpRxParser, &readByte, 1, NULL);
+        *received = true;
+    }
+#endif
+
+    return status;
+}
+
+/**
+ * @brief Waits for an RSCP message.
+ *
+ * With RSCP_USE_TIME_CALLBACK the whole frame must arrive within the
+ * timeout. Otherwise the timeout counts polls without a received byte.
+ *
+ * @param frame Pointer to the RSCP frame to be filled.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @param elapsed Optional pointer to add the number of ticks waited to.
+ * @return RSCP error code.
+ */
+static RSCP_ErrorType rscpWaitMsg(struct RSCP_frame *frame, uint32_t timeout_ticks, uint32_t *elapsed) {
+    RSCP_ErrorType err;
+    bool received;
+#if RSCP_USE_TIME_CALLBACK
+    uint32_t start = rscpNow();
+    uint32_t deadline = start + timeout_ticks;
+#else
+    uint32_t ticks = timeout_ticks;
+#endif
+
+    while (true) {
+        RSCP_ParseStatus status = rscpRxPump(&received);
+        if (status == RSCP_PARSE_FRAME_READY) {
+            if (frame != &rscpRxParser.frame) {
+                memcpy(frame, &rscpRxParser.frame, sizeof(*frame));
+            }
+            err = RSCP_ERR_OK;
+            break;
+        }
+        if (status == RSCP_PARSE_ERROR) {
+            err = rscpRxParser.error;
+            break;
+        }
+#if RSCP_USE_TIME_CALLBACK
+        if (rscpTimeReached(deadline)) {
+            err = RSCP_ERR_TIMEOUT;
+            break;
+        }
+#else
+        if (received) {
+            ticks = timeout_ticks;
+        }
+        if (ticks-- == 0) {
+            err = RSCP_ERR_TIMEOUT;
+            break;
+        }
+        if (elapsed != NULL) {
+            (*elapsed)++;
+        }
+#endif
+        rscpRxWaitingCallback();
+    }
+
+#if RSCP_USE_TIME_CALLBACK
+    if (elapsed != NULL) {
+        *elapsed += rscpNow() - start;
+    }
+#endif
+    return err;
+}
+
+//---[ Public Functions ]-------------------------------------------------------
+
+/**
+ * @brief Starts a streaming CRC-16/MODBUS computation.
+ *
+ * @return Initial CRC accumulator.
+ */
+uint16_t rscpCrc16Init(void) {
+    return RSCP_CRC16_INIT;
+}
+
+/**
+ * @brief Accumulates data into a streaming CRC-16/MODBUS computation.
+ *
+ * The algorithm is selected at compile time with RSCP_CRC_IMPL. All variants
+ * return the same value; they only trade flash/RAM for speed.
+ *
+ * @param crc Current CRC accumulator.
+ * @param data Pointer to the data.
+ * @param length Length of the data.
+ * @return Updated CRC accumulator.
+ */
+uint16_t rscpCrc16Update(uint16_t crc, const uint8_t *data, uint32_t length) {
+
+#if RSCP_CRC_IMPL == RSCP_CRC_IMPL_NIBBLE
+    while (length--) {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ rscpReadTableWord(&rscpCrc16NibbleTable[crc & 0x0F]);
+        crc = (crc >> 4) ^ rscpReadTableWord(&rscpCrc16NibbleTable[crc & 0x0F]);
+    }
+#elif RSCP_CRC_IMPL == RSCP_CRC_IMPL_TABLE
+    while (length--) {
+        crc = (crc >> 8) ^ rscpReadTableWord(&rscpCrc16Table[(crc ^ *data++) & 0xFF]);
+    }
+#elif RSCP_CRC_IMPL == RSCP_CRC_IMPL_SLICE_BY_8
+    while (length >= 8) {
+        crc ^= data[0] | (data[1] << 8);
+        crc = rscpCrc16Slices[7][crc & 0xFF] ^ rscpCrc16Slices[6][crc >> 8] ^
+              rscpCrc16Slices[5][data[2]] ^ rscpCrc16Slices[4][data[3]] ^
+              rscpCrc16Slices[3][data[4]] ^ rscpCrc16Slices[2][data[5]] ^
+              rscpCrc16Slices[1][data[6]] ^ rscpCrc16Slices[0][data[7]];
+        data += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = (crc >> 8) ^ rscpCrc16Slices[0][(crc ^ *data++) & 0xFF];
+    }
+#else
+    while (length--) {
+        crc ^= *data++;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = RSCP_CRC16_STEP(crc);
+        }
+    }
+#endif
+
+    return crc;
+}
+
+/**
+ * @brief Finishes a streaming CRC-16/MODBUS computation.
+ *
+ * @param crc Current CRC accumulator.
+ * @return CRC-16/MODBUS value.
+ */
+uint16_t rscpCrc16Final(uint16_t crc) {
+    return crc; // CRC-16/MODBUS has no final XOR
+}
+
+/**
+ * @brief Computes the CRC-16/MODBUS of a buffer.
+ *
+ * @param data Pointer to the data.
+ * @param length Length of the data.
+ * @return CRC-16/MODBUS value.
+ */
+uint16_t rscpCrc16(const uint8_t *data, uint32_t length) {
+    return rscpCrc16Final(rscpCrc16Update(rscpCrc16Init(), data, length));
+}
+
+/**
+ * @brief Resets a parser context, discarding any partially received frame.
+ *
+ * @param parser Pointer to the parser context.
+ */
+void rscpParserInit(struct RSCP_parser *parser) {
+    memset(parser, 0, sizeof(*parser));
+    parser->state = RSCP_RX_STATE_IDLE;
+}
+
+/**
+ * @brief Feeds received bytes into the parser without blocking.
+ *
+ * Parsing stops right after a complete frame (or an error), so bytes that
+ * belong to the next frame are left to the caller. Partial frames are kept
+ * in the context until more bytes are fed.
+ *
+ * @param parser Pointer to the parser context.
+ * @param bytes Pointer to the received bytes.
+ * @param length Number of received bytes.
+ * @param consumed Optional pointer to store the number of bytes consumed.
+ * @return RSCP_PARSE_NEED_MORE, RSCP_PARSE_FRAME_READY or RSCP_PARSE_ERROR.
+ */
+RSCP_ParseStatus rscpParserFeed(struct RSCP_parser *parser, const uint8_t *bytes, uint32_t length, uint32_t *consumed) {
+    RSCP_ParseStatus status = RSCP_PARSE_NEED_MORE;
+    uint32_t index = 0;
+
+#if RSCP_ENABLE_RESYNC
+    // Rescan bytes left over from a resync before taking new ones
+    while ((status == RSCP_PARSE_NEED_MORE) && (parser->replayIndex < parser->replayLength)) {
+        status = rscpParserPush(parser, parser->window[parser->replayIndex++]);
+    }
+    if (parser->replayIndex >= parser->replayLength) {
+        parser->replayIndex = 0;
+        parser->replayLength = 0;
+    }
+#endif
+
+    while ((index < length) && (status == RSCP_PARSE_NEED_MORE)) {
+        if (parser->state == RSCP_RX_STATE_DATA) {
+            // Copy and checksum the run of data bytes in one go
+            uint32_t run = parser->frame.length - sizeof(parser->frame.crc) - parser->dataIndex;
+            if (run > length - index) {
+                run = length - index;
+            }
+            memcpy(&parser->frame.data[parser->dataIndex], &bytes[index], run);
+#if RSCP_ENABLE_RESYNC
+            memcpy(&parser->window[parser->windowLength], &bytes[index], run);
+            parser->windowLength += run;
+#endif
+#if RSCP_CRC_IMPL != RSCP_CRC_IMPL_CALLBACK
+            parser->crc = rscpCrc16Update(parser->crc, &bytes[index], run);
+#endif
+            parser->dataIndex += run;
+            index += run;
+            if (parser->dataIndex >= parser->frame.length - sizeof(parser->frame.crc)) {
+                parser->state = RSCP_RX_STATE_CRC_HIGH;
+            }
+            continue;
+        }
+        status = rscpParserPush(parser, bytes[index++]);
+    }
+
+    if (consumed != NULL) {
+        *consumed = index;
+    }
+    return status;
+}
+
+/**
+ * @brief Blocking function to get a byte from the receive buffer.
+ *
+ * @param readByte Pointer to the variable to store the received byte.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return 0 on success, -1 on timeout.
+ */
+int32_t rscpGetRxByteBlocking(uint8_t *readByte, uint32_t timeout_ticks) {
+#if RSCP_USE_TIME_CALLBACK
+    uint32_t deadline = rscpNow() + timeout_ticks;
+#endif
+    while (rscpGetRxByteCallback(readByte) < 0) {
+#if RSCP_USE_TIME_CALLBACK
+        if (rscpTimeReached(deadline)) {
+#else
+        if (timeout_ticks-- == 0) {
+#endif
+            return -1;
+        }
+        rscpRxWaitingCallback();
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives an RSCP message.
+ *
+ * The receive state is kept between calls, so a timeout does not drop a
+ * partially received frame; the next call resumes where this one stopped.
+ *
+ * @param frame Pointer to the RSCP frame to be filled.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpGetMsg(struct RSCP_frame *frame, uint32_t timeout_ticks) {
+    return rscpWaitMsg(frame, timeout_ticks, NULL);
+}
+
+/**
+ * @brief Serializes an RSCP message into a wire frame.
+ *
+ * @param buffer Buffer of at least RSCP_MAX_TX_BUFFER_SIZE bytes, or the
+ *               wire size of the frame.
+ * @param command This is the command byte to send.
+ * @param sequence Sequence byte to stamp, RSCP_NO_SEQUENCE for none.
+ * @param data Pointer to the data to be sent. It may overlap the buffer, as
+ *             when a reply is filled in at RSCP_TX_DATA_OFFSET of the arena.
+ * @param dataLength Length of the data to be sent, up to RSCP_MAX_DATA_LENGTH.
+ * @return Length of the frame in bytes.
+ */
+static uint8_t rscpBuildMsg(uint8_t *buffer, uint8_t command, int16_t sequence, const uint8_t *data, uint8_t dataLength) {
+    uint8_t index = 3; // Preamble, length and command
+#if RSCP_ENABLE_SEQUENCE
+    if (sequence != RSCP_NO_SEQUENCE) {
+        index++;
+    }
+#endif
+
+    // Move the data first, the header may overwrite where it came from
+    memmove(&buffer[index], data, dataLength);
+
+    buffer[0] = RSCP_PREAMBLE_BYTE;
+    buffer[1] = (index - 1) + dataLength;
+    buffer[2] = command;
+#if RSCP_ENABLE_SEQUENCE
+    if (sequence != RSCP_NO_SEQUENCE) {
+        buffer[2] |= RSCP_CMD_FLAG_SEQUENCE;
+        buffer[3] = (uint8_t)sequence;
+    }
+#else
+    (void)sequence;
+#endif
+    index += dataLength;
+
+    uint16_t crc = rscpGetCrc(&buffer[1], index - 1);
+    buffer[index++] = (crc >> 8) & 0xFF;
+    buffer[index++] = (crc & 0xFF);
+
+    return index;
+}
+
+/**
+ * @brief Hands a complete frame to the transport.
+ *
+ * In event-driven slave mode the frame is staged for rscpOnRequest instead.
+ *
+ * @param frame Pointer to the wire frame.
+ * @param length Length of the frame in bytes.
+ * @return RSCP error code.
+ */
+static RSCP_ErrorType rscpSendFrame(const uint8_t *frame, uint8_t length) {
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_REPLAY_CACHE
+    if ((rscpReplayRecord != NULL) && (length <= sizeof(rscpReplayRecord->frame))) {
+        memcpy(rscpReplayRecord->frame, frame, length);
+        rscpReplayRecord->length = length;
+    }
+#endif
+#if !RSCP_DEVICE_IS_MASTER && RSCP_ENABLE_EVENT_DRIVEN
+    memcpy(rscpStagedReply, frame, length);
+    rscpStagedFrame = rscpStagedReply;
+    rscpStagedIndex = 0;
+    rscpStagedLength = length;
+#else
+    if (rscpSendSlotCallback((uint8_t*)frame, length) < 0) {
+        return RSCP_ERR_TX_FAILED;
+    }
+#endif
+
+    return RSCP_ERR_OK;
+}
+
+/**
+ * @brief Sends an RSCP message.
+ * 
+ * @param command This is the command byte to send.
+ * @param data Pointer to the data to be sent.
+ * @param dataLength Length of the data to be sent, up to RSCP_MAX_DATA_LENGTH.
+ * @return RSCP error code. 
+ *
+ * With RSCP_ENABLE_SEQUENCE the frame carries rscpTxSequence, if set. With
+ * RSCP_ENABLE_STATIC_ARENA it is built in the static transmit buffer, and data
+ * may already be there at RSCP_TX_DATA_OFFSET.
+ */
+RSCP_ErrorType rscpSendMsg(uint8_t command, uint8_t* data, uint8_t dataLength) {
+    rscpDeclareTxBuffer(txBuffer);
+    uint8_t txBufferLength;
+
+    if (dataLength > RSCP_MAX_DATA_LENGTH) {
+        return RSCP_ERR_OVERFLOW;
+    }
+
+#if RSCP_ENABLE_SEQUENCE
+    txBufferLength = rscpBuildMsg(txBuffer, command, rscpTxSequence, data, dataLength);
+#else
+    txBufferLength = rscpBuildMsg(txBuffer, command, RSCP_NO_SEQUENCE, data, dataLength);
+#endif
+
+    return rscpSendFrame(txBuffer, txBufferLength);
+}
+
+#if RSCP_DEVICE_IS_MASTER
+
+/**
+ * @brief Counts the asynchronous transactions waiting for their reply.
+ *
+ * @return Number of transactions in RSCP_ASYNC_STATE_RECEIVE.
+ */
+static uint8_t rscpAsyncReceiving(void) {
+    uint8_t count = 0;
+
+    for (uint8_t i = 0; i < RSCP_ASYNC_SLOTS; i++) {
+        if (rscpAsync[i].state == RSCP_ASYNC_STATE_RECEIVE) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Finds the protocol version reported by the selected slave.
+ *
+ * Slaves are taken for RSCP_DEF_PROTOCOL_VERSION_BASE until they answer
+ * RSCP_CMD_CPU_QUERY.
+ *
+ * @return Pointer to the version.
+ */
+static uint8_t * rscpPeerProtocolVersion(void) {
+#if RSCP_ENABLE_MULTI_SLAVE
+    if (rscpSelectedSlave != NULL) {
+        return &rscpSelectedSlave->protocolVersion;
+    }
+#endif
+    return &rscpDefaultProtocolVersion;
+}
+
+/**
+ * @brief Finds the changes of the selected slave that are still to be acknowledged.
+ *
+ * @return Pointer to the RSCP_DEF_DIRTY_* bits.
+ */
+static uint8_t * rscpPeerChangesAck(void) {
+#if RSCP_ENABLE_MULTI_SLAVE
+    if (rscpSelectedSlave != NULL) {
+        return &rscpSelectedSlave->changesAck;
+    }
+#endif
+    return &rscpDefaultChangesAck;
+}
+
+/**
+ * @brief Picks the sequence number for a new request to the selected slave.
+ *
+ * @param command The command byte to send.
+ * @return Next sequence number, or RSCP_NO_SEQUENCE if the request is sent without one.
+ */
+static int16_t rscpNewSequence(uint8_t command) {
+#if RSCP_ENABLE_SEQUENCE
+    // The version query must be understood by slaves without sequence support
+    if ((command != RSCP_CMD_CPU_QUERY) && (*rscpPeerProtocolVersion() >= RSCP_DEF_PROTOCOL_VERSION_SEQUENCE)) {
+        return rscpNextSequence++;
+    }
+#endif
+    (void)command;
+    return RSCP_NO_SEQUENCE;
+}
+
+/**
+ * @brief Sends a request and opens the receive slot for its reply.
+ *
+ * @param command The command byte to send.
+ * @param sequence Sequence number to stamp, or RSCP_NO_SEQUENCE.
+ * @param data Pointer to the data to be sent.
+ * @param dataLength Length of the data to be sent.
+ * @param replyLength Length of the expected reply data.
+ * @return RSCP error code.
+ */
+static RSCP_ErrorType rscpMasterStart(uint8_t command, int16_t sequence, uint8_t *data, uint8_t dataLength, uint8_t replyLength) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+
+    if (rscpAsyncReceiving() == 0) {
+        rscpRxReset(); // Drop leftovers of a previous transaction
+    }
+
+#if RSCP_ENABLE_SEQUENCE
+    rscpTxSequence = sequence;
+    err = rscpSendMsg(command, data, dataLength);
+    rscpTxSequence = RSCP_NO_SEQUENCE;
+#else
+    err = rscpSendMsg(command, data, dataLength);
+#endif
+    if (err != RSCP_ERR_OK) {
+        return err;
+    }
+
+    uint32_t rxBufferMaxLength = 1 + sizeof(uint8_t) + sizeof(uint8_t) + replyLength + sizeof(uint16_t) +
+                                 ((sequence != RSCP_NO_SEQUENCE) ? 1 : 0);
+
+    if (rscpRequestSlotCallback(rxBufferMaxLength) < 0) {
+        return RSCP_ERR_REQUEST_FAILED;
+    }
+
+    return err;
+}
+
+/**
+ * @brief Receives the reply to a blocking request.
+ *
+ * Replies carrying another sequence number belong to earlier requests that
+ * already timed out, and are dropped.
+ *
+ * @param frame Pointer to the RSCP frame to be filled.
+ * @param sequence Sequence number of the request, or RSCP_NO_SEQUENCE.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @param elapsed Optional pointer to add the number of ticks waited to.
+ * @return RSCP error code.
+ */
+static RSCP_ErrorType rscpMasterReceive(struct RSCP_frame *frame, int16_t sequence, uint32_t timeout_ticks, uint32_t *elapsed) {
+    RSCP_ErrorType err;
+#if RSCP_ENABLE_SEQUENCE && RSCP_USE_TIME_CALLBACK
+    uint32_t deadline = rscpNow() + timeout_ticks;
+#endif
+
+    while ((err = rscpWaitMsg(frame, timeout_ticks, elapsed)) == RSCP_ERR_OK) {
+#if RSCP_ENABLE_SEQUENCE
+        if (frame->sequence != sequence) {
+#if RSCP_USE_TIME_CALLBACK
+            // Stale replies do not extend the deadline
+            timeout_ticks = rscpTimeReached(deadline) ? 0 : (deadline - rscpNow());
+#endif
+            continue; // Stale reply
+        }
+#endif
+        break;
+    }
+    (void)sequence;
+
+    return err;
+}
+
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+
+/**
+ * @brief Finds the round-trip estimate of a command on the selected slave.
+ *
+ * @param command The command byte.
+ * @return Pointer to the estimate.
+ */
+static struct RSCP_rtt * rscpRttFor(uint8_t command) {
+    uint8_t index = (command < RSCP_RTT_COMMANDS) ? command : (RSCP_RTT_COMMANDS - 1);
+
+#if RSCP_ENABLE_MULTI_SLAVE
+    if (rscpSelectedSlave != NULL) {
+        return &rscpSelectedSlave->rtt[index];
+    }
+#endif
+    return &rscpRtt[index];
+}
+
+/**
+ * @brief Computes the timeout of an attempt from the round-trip estimate.
+ *
+ * The timeout is srtt + 4 * rttvar (Jacobson/Karels), doubled for every
+ * retry and bounded by the caller's timeout. Without a measurement yet the
+ * caller's timeout is used as is.
+ *
+ * @param rtt Pointer to the estimate.
+ * @param attempt Number of retries made so far.
+ * @param timeout_ticks Upper bound chosen by the caller.
+ * @return Timeout of the attempt in ticks.
+ */
+static uint32_t rscpRttTimeout(const struct RSCP_rtt *rtt, uint8_t attempt, uint32_t timeout_ticks) {
+    if (rtt->srtt == 0) {
+        return timeout_ticks;
+    }
+
+    uint32_t rto = (rtt->srtt >> 3) + rtt->rttvar;
+    if (rto < RSCP_RTO_MIN) {
+        rto = RSCP_RTO_MIN;
+    }
+    rto <<= attempt;
+
+    return (rto < timeout_ticks) ? rto : timeout_ticks;
+}
+
+/**
+ * @brief Feeds a measured round-trip time into an estimate.
+ *
+ * Only replies to first attempts are measured, as a reply to a retried
+ * request cannot be told apart from a late reply to the first one.
+ *
+ * @param rtt Pointer to the estimate.
+ * @param elapsed Measured round-trip time in ticks.
+ */
+static void rscpRttSample(struct RSCP_rtt *rtt, uint32_t elapsed) {
+    // Keep the scaled values within 16 bits
+    int32_t sample = (elapsed < 1) ? 1 : ((elapsed > 0x0FFF) ? 0x0FFF : (int32_t)elapsed);
+
+    if (rtt->srtt == 0) {
+        rtt->srtt = sample << 3;
+        rtt->rttvar = sample << 1;
+        return;
+    }
+
+    int32_t delta = (sample << 3) - rtt->srtt;   // Error, scaled by 8
+    rtt->srtt += delta / 8;
+    if (delta < 0) {
+        delta = -delta;
+    }
+    rtt->rttvar += ((delta / 2) - rtt->rttvar) / 4;
+}
+
+#endif
+
+/**
+ * @brief Sends a request and waits for its reply.
+ *
+ * With RSCP_ENABLE_ADAPTIVE_TIMEOUT each attempt waits for the learnt
+ * timeout and timed out requests are sent again up to RSCP_MAX_RETRIES
+ * times. An attempt that already waited the whole timeout_ticks, e.g.
+ * because no round trip was measured yet, is not retried.
+ *
+ * @param command The command byte to send.
+ * @param data Pointer to the data to be sent.
+ * @param dataLength Length of the data to be sent.
+ * @param replyLength Length of the expected reply data.
+ * @param frame Pointer to the reply frame to be filled.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return RSCP error code.
+ */
+static RSCP_ErrorType rscpMasterExchange(uint8_t command, uint8_t *data, uint8_t dataLength, uint8_t replyLength,
+                                         struct RSCP_frame *frame, uint32_t timeout_ticks) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+    int16_t sequence = rscpNewSequence(command);
+
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+    struct RSCP_rtt *rtt = rscpRttFor(command);
+    uint32_t elapsed = 0;
+    uint8_t attempt = 0;
+#if RSCP_USE_TIME_CALLBACK
+    uint32_t deadline = rscpNow() + timeout_ticks; // Retries must fit in the caller's budget
+#endif
+
+    while (true) {
+        uint32_t timeout = rscpRttTimeout(rtt, attempt, timeout_ticks);
+#if RSCP_USE_TIME_CALLBACK
+        if (timeout > deadline - rscpNow()) {
+            timeout = deadline - rscpNow();
+        }
+#endif
+        if ((err = rscpMasterStart(command, sequence, data, dataLength, replyLength)) != RSCP_ERR_OK) {
+            return err;
+        }
+        err = rscpMasterReceive(frame, sequence, timeout, &elapsed);
+        if ((err != RSCP_ERR_TIMEOUT) || (attempt >= RSCP_MAX_RETRIES) || (timeout >= timeout_ticks)) {
+            break;
+        }
+#if RSCP_USE_TIME_CALLBACK
+        if (rscpTimeReached(deadline)) {
+            break;
+        }
+#endif
+        attempt++; // Same sequence, so a late reply to the first attempt still counts
+    }
+    if ((err == RSCP_ERR_OK) && (attempt == 0)) {
+        rscpRttSample(rtt, elapsed);
+    }
+#else
+    if ((err = rscpMasterStart(command, sequence, data, dataLength, replyLength)) != RSCP_ERR_OK) {
+        return err;
+    }
+    err = rscpMasterReceive(frame, sequence, timeout_ticks, NULL);
+#endif
+
+    return err;
+}
+
+/**
+ * @brief Finds the negotiated data length limit of the selected slave.
+ *
+ * @return Pointer to the limit.
+ */
+static uint8_t * rscpPeerDataLength(void) {
+#if RSCP_ENABLE_MULTI_SLAVE
+    if (rscpSelectedSlave != NULL) {
+        return &rscpSelectedSlave->maxDataLength;
+    }
+#endif
+    return &rscpDefaultDataLength;
+}
+
+/**
+ * @brief Converts the packetMaxLen reported by a slave into a data length limit.
+ *
+ * Slaves that predate negotiation report sizeof(struct RSCP_frame), which
+ * maps to RSCP_DEF_BASE_DATA_LENGTH.
+ *
+ * @param packetMaxLen Value reported in RSCP_CMD_CPU_QUERY.
+ * @return Largest data length both sides support.
+ */
+static uint8_t rscpNegotiateDataLength(uint16_t packetMaxLen) {
+    if (packetMaxLen < RSCP_DEF_PACKET_OVERHEAD + RSCP_DEF_BASE_DATA_LENGTH) {
+        return RSCP_DEF_BASE_DATA_LENGTH;
+    }
+    if (packetMaxLen - RSCP_DEF_PACKET_OVERHEAD > RSCP_MAX_DATA_LENGTH) {
+        return RSCP_MAX_DATA_LENGTH;
+    }
+    return (uint8_t)(packetMaxLen - RSCP_DEF_PACKET_OVERHEAD);
+}
+
+/**
+ * @brief Checks a reply frame and extracts its result.
+ *
+ * @param frame Pointer to the received reply frame.
+ * @param command The command byte that was sent.
+ * @param reply Pointer to the reply data to be filled, NULL for actions.
+ * @param replyLength Length of the reply data to be filled.
+ * @return RSCP error code. For actions, the status reported by the slave.
+ */
+static RSCP_ErrorType rscpMasterFinish(const struct RSCP_frame *frame, uint8_t command, uint8_t *reply, uint8_t replyLength) {
+    if (frame->command != command) {
+        return RSCP_ERR_INVALID_ANSWER;
+    }
+
+    if (reply == NULL) {
+        return (RSCP_ErrorType)(int8_t)frame->data[0];
+    }
+
+    for (uint32_t i = 0; i < replyLength; i++) {
+        reply[i] = frame->data[i];
+    }
+
+    // Every CPU query renegotiates the frame size and version with the selected slave
+    if ((command == RSCP_CMD_CPU_QUERY) && (frame->length - 2 >= (int)sizeof(struct RSCP_Reply_cpuquery))) {
+        const struct RSCP_Reply_cpuquery *capabilities = (const struct RSCP_Reply_cpuquery *)frame->data;
+        *rscpPeerDataLength() = rscpNegotiateDataLength(capabilities->packetMaxLen);
+        *rscpPeerProtocolVersion() = capabilities->protocolversion;
+    }
+
+    return RSCP_ERR_OK;
+}
+
+#if RSCP_ENABLE_MULTI_SLAVE
+
+/**
+ * @brief Updates the health of a slave after a transaction.
+ *
+ * Every consecutive failure doubles the number of polls the scheduler skips
+ * the slave, up to RSCP_SLAVE_MAX_HOLDOFF.
+ *
+ * @param slave Pointer to the slave, may be NULL.
+ * @param err Result of the transaction.
+ */
+static void rscpSlaveUpdateHealth(struct RSCP_slave *slave, RSCP_ErrorType err) {
+    if (slave == NULL) {
+        return;
+    }
+
+    switch (err) {
+        case RSCP_ERR_TIMEOUT:
+        case RSCP_ERR_MALFORMED:
+        case RSCP_ERR_TX_FAILED:
+        case RSCP_ERR_REQUEST_FAILED:
+            if (slave->failures < 15) {
+                slave->failures++;
+            }
+            slave->holdoff = ((1UL << slave->failures) > RSCP_SLAVE_MAX_HOLDOFF) ?
+                             RSCP_SLAVE_MAX_HOLDOFF : (1UL << slave->failures);
+            break;
+        default:
+            // The slave answered, even if the command itself failed
+            slave->failures = 0;
+            slave->holdoff = 0;
+            break;
+    }
+}
+
+/**
+ * @brief Chooses the next pending transaction to run.
+ *
+ * Takes the highest priority present in the queue. Within it, slaves are
+ * served round-robin starting after the last one served, and slaves that are
+ * busy or held off after failures are skipped unless the action is urgent.
+ *
+ * @return Index in the queue, or -1 if nothing can run now.
+ */
+static int16_t rscpSchedulerPick(void) {
+    int16_t best = -1;
+    uint8_t bestDistance = 0;
+
+    for (uint8_t i = 0; i < rscpQueueCount; i++) {
+        const struct RSCP_transaction *transaction = &rscpQueue[i];
+        const struct RSCP_slave *slave = transaction->slave;
+        uint8_t distance = 0;
+
+        if ((best >= 0) && (transaction->priority < rscpQueue[best].priority)) {
+            break; // The queue is sorted by priority
+        }
+        if (slave != NULL) {
+            if ((transaction->priority != RSCP_PRIORITY_URGENT) &&
+                ((slave->flags & RSCP_SLAVE_FLAG_BUSY) || (slave->holdoff > 0))) {
+                continue;
+            }
+            distance = (uint8_t)((slave - rscpSlaves) + RSCP_MAX_SLAVES - rscpLastSlaveIndex - 1) % RSCP_MAX_SLAVES;
+        }
+        if ((best < 0) || (distance < bestDistance)) {
+            best = i;
+            bestDistance = distance;
+        }
+    }
+
+    return best;
+}
+
+#endif
+
+/**
+ * @brief Completes an asynchronous transaction.
+ *
+ * The slot is released before the callback runs, so the callback may
+ * submit the next transaction.
+ *
+ * @param transaction Pointer to the transaction slot.
+ * @param err Result of the transaction.
+ */
+static void rscpAsyncComplete(struct RSCP_transaction *transaction, RSCP_ErrorType err) {
+    RSCP_CompletionCallback callback = transaction->callback;
+    void *context = transaction->context;
+
+#if RSCP_ENABLE_MULTI_SLAVE
+    rscpSlaveUpdateHealth(transaction->slave, err);
+#endif
+    transaction->state = RSCP_ASYNC_STATE_IDLE;
+    if (callback != NULL) {
+        callback(context, err);
+    }
+}
+
+/**
+ * @brief Finds a free asynchronous transaction slot.
+ *
+ * @return Pointer to the slot, or NULL if all are in use.
+ */
+static struct RSCP_transaction * rscpAsyncFreeSlot(void) {
+    for (uint8_t i = 0; i < RSCP_ASYNC_SLOTS; i++) {
+        if (rscpAsync[i].state == RSCP_ASYNC_STATE_IDLE) {
+            return &rscpAsync[i];
+        }
+    }
+    return NULL;
+}
+
+#if RSCP_ENABLE_SEQUENCE
+
+/**
+ * @brief Tells whether a transaction will be sent with a sequence number.
+ *
+ * Only those can share the bus with other requests in flight.
+ *
+ * @param transaction Pointer to the transaction.
+ * @return true if it will be sequenced.
+ */
+static bool rscpAsyncSequenced(const struct RSCP_transaction *transaction) {
+    uint8_t version = *rscpPeerProtocolVersion();
+
+    if (transaction->command == RSCP_CMD_CPU_QUERY) {
+        return false;
+    }
+#if RSCP_ENABLE_MULTI_SLAVE
+    if (transaction->slave != NULL) {
+        version = transaction->slave->protocolVersion;
+    }
+#endif
+    // Slaves that did not report sequence support yet get plain frames
+    return (version >= RSCP_DEF_PROTOCOL_VERSION_SEQUENCE);
+}
+
+/**
+ * @brief Tells whether a transaction may be sent now.
+ *
+ * An unsequenced request must be the only one in flight, as its reply
+ * cannot be told apart from others.
+ *
+ * @param transaction Pointer to the candidate transaction.
+ * @return true if it can be sent.
+ */
+static bool rscpAsyncCanLaunch(const struct RSCP_transaction *transaction) {
+    if (rscpAsyncReceiving() == 0) {
+        return true;
+    }
+    if (!rscpAsyncSequenced(transaction)) {
+        return false;
+    }
+    for (uint8_t i = 0; i < RSCP_ASYNC_SLOTS; i++) {
+        if ((rscpAsync[i].state == RSCP_ASYNC_STATE_RECEIVE) && (rscpAsync[i].sequence == RSCP_NO_SEQUENCE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
+
+/**
+ * @brief Computes the timeout of the current attempt of a transaction.
+ *
+ * @param transaction Pointer to the transaction.
+ * @return Timeout in ticks.
+ */
+static uint32_t rscpAsyncTimeout(const struct RSCP_transaction *transaction) {
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+    return rscpRttTimeout(transaction->rtt, transaction->attempts, transaction->timeout_ticks);
+#else
+    return transaction->timeout_ticks;
+#endif
+}
+
+/**
+ * @brief Starts timing the attempt that was just sent.
+ *
+ * @param transaction Pointer to the transaction.
+ */
+static void rscpAsyncArm(struct RSCP_transaction *transaction) {
+#if RSCP_USE_TIME_CALLBACK
+    uint32_t attemptDeadline;
+
+    transaction->sentAt = rscpNow();
+    if (transaction->attempts == 0) {
+        transaction->deadline = transaction->sentAt + transaction->timeout_ticks;
+    }
+    // Retries must fit in the caller's budget
+    attemptDeadline = transaction->sentAt + rscpAsyncTimeout(transaction);
+    transaction->attemptDeadline = ((int32_t)(attemptDeadline - transaction->deadline) < 0) ?
+                                   attemptDeadline : transaction->deadline;
+#else
+    transaction->ticks = rscpAsyncTimeout(transaction);
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+    transaction->elapsed = 0;
+#endif
+#endif
+}
+
+/**
+ * @brief Checks whether the current attempt of a transaction timed out.
+ *
+ * @param transaction Pointer to the transaction.
+ * @param received true if bytes were received in this poll.
+ * @return true if the attempt timed out.
+ */
+static bool rscpAsyncExpired(struct RSCP_transaction *transaction, bool received) {
+#if RSCP_USE_TIME_CALLBACK
+    (void)received;
+    return rscpTimeReached(transaction->attemptDeadline);
+#else
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+    transaction->elapsed++;
+#endif
+    if (received) {
+        transaction->ticks = rscpAsyncTimeout(transaction);
+        return false;
+    }
+    return (transaction->ticks-- == 0);
+#endif
+}
+
+/**
+ * @brief Sends a transaction and starts waiting for its reply.
+ *
+ * @param transaction Pointer to the transaction slot.
+ */
+static void rscpAsyncLaunch(struct RSCP_transaction *transaction) {
+    RSCP_ErrorType err;
+    int16_t sequence = RSCP_NO_SEQUENCE;
+
+#if RSCP_ENABLE_MULTI_SLAVE
+    if ((transaction->slave != NULL) && ((err = rscpSlaveSelect(transaction->slave)) != RSCP_ERR_OK)) {
+        rscpAsyncComplete(transaction, err);
+        return;
+    }
+#endif
+#if RSCP_ENABLE_SEQUENCE
+    if (transaction->attempts == 0) {
+        transaction->sequence = rscpAsyncSequenced(transaction) ? rscpNewSequence(transaction->command) : RSCP_NO_SEQUENCE;
+    }
+    sequence = transaction->sequence; // Retries reuse it, so a late reply still matches
+#endif
+
+    err = rscpMasterStart(transaction->command, sequence, transaction->data, transaction->dataLength,
+                          (transaction->reply != NULL) ? transaction->replyLength : 1);
+    if (err != RSCP_ERR_OK) {
+        rscpAsyncComplete(transaction, err);
+        return;
+    }
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+    transaction->rtt = rscpRttFor(transaction->command);
+#endif
+    rscpAsyncArm(transaction);
+    transaction->state = RSCP_ASYNC_STATE_RECEIVE;
+}
+
+/**
+ * @brief Finds the transaction a received reply belongs to.
+ *
+ * @param frame Pointer to the received reply frame.
+ * @return Pointer to the transaction, or NULL for a stale reply.
+ */
+static struct RSCP_transaction * rscpAsyncMatch(const struct RSCP_frame *frame) {
+    for (uint8_t i = 0; i < RSCP_ASYNC_SLOTS; i++) {
+        // Replies echo the command, so a late reply to another request is dropped
+        if ((rscpAsync[i].state == RSCP_ASYNC_STATE_RECEIVE) && (rscpAsync[i].command == frame->command)
+#if RSCP_ENABLE_SEQUENCE
+            && (rscpAsync[i].sequence == frame->sequence)
+#endif
+           ) {
+            return &rscpAsync[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Derives the scheduling priority of a transaction.
+ *
+ * Stopping a shutter is urgent, other actions go before status polls.
+ *
+ * @param transaction Pointer to the transaction.
+ * @return RSCP_PRIORITY_* value.
+ */
+static uint8_t rscpGetPriority(const struct RSCP_transaction *transaction) {
+    if ((transaction->command == RSCP_CMD_SET_SHUTTER_ACTION) &&
+        (transaction->dataLength >= sizeof(struct RSCP_Arg_rollershutter)) &&
+        (((const struct RSCP_Arg_rollershutter *)transaction->data)->action == RSCP_DEF_SHUTTER_ACTION_STOP)) {
+        return RSCP_PRIORITY_URGENT;
+    }
+    if ((transaction->command == RSCP_CMD_SET_SHUTTER_GROUP_ACTION) &&
+        (transaction->dataLength >= sizeof(struct RSCP_Arg_rollershutter_group)) &&
+        (((const struct RSCP_Arg_rollershutter_group *)transaction->data)->action == RSCP_DEF_SHUTTER_ACTION_STOP)) {
+        return RSCP_PRIORITY_URGENT;
+    }
+    if (transaction->reply != NULL) {
+        return RSCP_PRIORITY_LOW;
+    }
+    return RSCP_PRIORITY_NORMAL;
+}
+
+/**
+ * @brief Inserts a transaction in the pending queue by priority.
+ *
+ * @param transaction Pointer to the transaction to copy into the queue.
+ * @param ahead Insert before transactions of the same priority instead of after them.
+ * @return RSCP_ERR_OK or RSCP_ERR_TASK_BUFFER_FULL.
+ */
+static RSCP_ErrorType rscpQueueInsert(const struct RSCP_transaction *transaction, bool ahead) {
+    uint8_t position = 0;
+
+    if (rscpQueueCount >= RSCP_TRANSACTION_QUEUE_SIZE) {
+        return RSCP_ERR_TASK_BUFFER_FULL;
+    }
+
+    while ((position < rscpQueueCount) &&
+           ((rscpQueue[position].priority > transaction->priority) ||
+            (!ahead && (rscpQueue[position].priority == transaction->priority)))) {
+        position++;
+    }
+
+    memmove(&rscpQueue[position + 1], &rscpQueue[position],
+            (rscpQueueCount - position) * sizeof(rscpQueue[0]));
+    rscpQueue[position] = *transaction;
+    rscpQueueCount++;
+
+    return RSCP_ERR_OK;
+}
+
+/**
+ * @brief Sends a data request and receives the reply from the slave.
+ * 
+ * @param command command byte of the type of data to request.
+ * @param reply Pointer to the reply data that is to be filled.
+ * @param replyLength Length of the reply data to be filled.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return RSCP_ErrorType 
+ */
+RSCP_ErrorType rscpRequestData(uint8_t command, uint8_t * reply, uint8_t replyLength, uint32_t timeout_ticks) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+
+    uint8_t data [] = { 0x00 }; // No data
+
+    rscpDeclareFrame(frame);
+
+    if ((err = rscpMasterExchange(command, (uint8_t*)&data[0], sizeof(data), replyLength, frame, timeout_ticks)) != RSCP_ERR_OK) {
+        return err;
+    }
+
+    return rscpMasterFinish(frame, command, reply, replyLength);
+}
+
+/**
+ * @brief Sends a command action and receives the reply.
+ * 
+ * @param command The command byte of the type of action to send.
+ * @param reply Pointer to the action argument.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpSendAction(uint8_t command, uint8_t *data, uint8_t dataLength, uint32_t timeout_ticks) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+
+    if (dataLength > rscpGetMaxDataLength()) {
+        return RSCP_ERR_OVERFLOW;
+    }
+
+    rscpDeclareFrame(frame);
+
+    if ((err = rscpMasterExchange(command, (uint8_t*)&data[0], dataLength, 1, frame, timeout_ticks)) != RSCP_ERR_OK) {
+        return err;
+    }
+
+    return rscpMasterFinish(frame, command, NULL, 0);
+}
+
+/**
+ * @brief Empties a batch.
+ *
+ * @param batch Pointer to the batch.
+ */
+void rscpBatchInit(struct RSCP_batch *batch) {
+    batch->length = 0;
+    batch->count = 0;
+}
+
+/**
+ * @brief Appends an action to a batch.
+ *
+ * @param batch Pointer to the batch.
+ * @param command The action command byte.
+ * @param data Pointer to the action argument.
+ * @param dataLength Length of the action argument.
+ * @return RSCP_ERR_OK, or RSCP_ERR_OVERFLOW if it does not fit in one frame.
+ */
+RSCP_ErrorType rscpBatchAdd(struct RSCP_batch *batch, uint8_t command, const uint8_t *data, uint8_t dataLength) {
+    if ((uint32_t)(batch->length + RSCP_DEF_BATCH_HEADER_SIZE + dataLength) > sizeof(batch->data)) {
+        return RSCP_ERR_OVERFLOW;
+    }
+
+    batch->data[batch->length++] = command;
+    batch->data[batch->length++] = dataLength;
+    memcpy(&batch->data[batch->length], data, dataLength);
+    batch->length += dataLength;
+    batch->count++;
+
+    return RSCP_ERR_OK;
+}
+
+/**
+ * @brief Sends a batch of actions in one frame and receives their results.
+ *
+ * @param batch Pointer to the batch.
+ * @param results Pointer to batch->count results to be filled, in submission order.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return RSCP_ERR_OK if the slave ran the batch, otherwise the reason it did not.
+ */
+RSCP_ErrorType rscpSendBatch(const struct RSCP_batch *batch, RSCP_ErrorType *results, uint32_t timeout_ticks) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+
+    if (batch->length > rscpGetMaxDataLength()) {
+        return RSCP_ERR_OVERFLOW;
+    }
+
+    rscpDeclareFrame(frame);
+
+    if ((err = rscpMasterExchange(RSCP_CMD_BATCH, (uint8_t *)batch->data, batch->length, batch->count,
+                                  frame, timeout_ticks)) != RSCP_ERR_OK) {
+        return err;
+    }
+
+    if (frame->command != RSCP_CMD_BATCH) {
+        return RSCP_ERR_INVALID_ANSWER;
+    }
+
+    uint8_t resultCount = frame->length - 2;
+    if (resultCount != batch->count) {
+        // A slave without batch support answers with a single status
+        return (resultCount == 1) ? (RSCP_ErrorType)(int8_t)frame->data[0] : RSCP_ERR_INVALID_ANSWER;
+    }
+
+    for (uint8_t i = 0; i < resultCount; i++) {
+        results[i] = (RSCP_ErrorType)(int8_t)frame->data[i];
+    }
+
+    return RSCP_ERR_OK;
+}
+
+/**
+ * @brief Reads the state that changed on the slave since it was last read.
+ *
+ * The request acknowledges the items of the previous reply, and the slave
+ * keeps reporting an item until then. After an error, call it again to get
+ * the changes that were lost with the reply.
+ *
+ * @param changes Pointer to the changes to be filled. Only the items flagged
+ *                in changes->dirty are valid.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpRequestChanges(struct RSCP_Reply_changes *changes, uint32_t timeout_ticks) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+    uint8_t *acknowledge = rscpPeerChangesAck();
+    struct RSCP_Arg_changes arg = { (uint8_t)(RSCP_DEF_CHANGES_ACK | *acknowledge) };
+    rscpDeclareFrame(frame);
+
+    // Sent once, if this reply is lost the slave reports the same items again
+    *acknowledge = 0;
+
+    if ((err = rscpMasterExchange(RSCP_CMD_GET_CHANGES, (uint8_t*)&arg, sizeof(arg), sizeof(*changes),
+                                  frame, timeout_ticks)) != RSCP_ERR_OK) {
+        return err;
+    }
+
+    if ((frame->command != RSCP_CMD_GET_CHANGES) || (frame->length < 3)) {
+        return RSCP_ERR_INVALID_ANSWER;
+    }
+
+    // Unpack the items that were sent
+    uint8_t length = frame->length - 2;
+    uint8_t index = 1;
+    changes->dirty = frame->data[0];
+    if (changes->dirty & RSCP_DEF_DIRTY_SHUTTER) {
+        if (index + sizeof(changes->shutter) > length) {
+            return RSCP_ERR_MALFORMED;
+        }
+        memcpy(&changes->shutter, &frame->data[index], sizeof(changes->shutter));
+        index += sizeof(changes->shutter);
+    }
+    if (changes->dirty & RSCP_DEF_DIRTY_RELAY) {
+        if (index + sizeof(changes->relay) > length) {
+            return RSCP_ERR_MALFORMED;
+        }
+        memcpy(&changes->relay, &frame->data[index], sizeof(changes->relay));
+        index += sizeof(changes->relay);
+    }
+    if (changes->dirty & RSCP_DEF_DIRTY_BUTTON) {
+        if (index + sizeof(changes->button) > length) {
+            return RSCP_ERR_MALFORMED;
+        }
+        memcpy(&changes->button, &frame->data[index], sizeof(changes->button));
+    }
+
+    *acknowledge = changes->dirty & RSCP_DEF_DIRTY_ALL;
+
+    return RSCP_ERR_OK;
+}
+
+/**
+ * @brief Reads the shutters, relay and button state of the slave at once.
+ *
+ * The request tells the slave how many shutters fit in this master's
+ * struct RSCP_Reply_allstate, so both sides agree on the reply whatever
+ * their RSCP_MAX_DATA_LENGTH.
+ *
+ * @param state Pointer to the state to be filled. Only the first
+ *              state->shutterCount shutters are valid.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpRequestAllState(struct RSCP_Reply_allstate *state, uint32_t timeout_ticks) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+    struct RSCP_Arg_allstate arg = { RSCP_DEF_ALL_STATE_MAX_SHUTTERS };
+    rscpDeclareFrame(frame);
+
+    if ((err = rscpMasterExchange(RSCP_CMD_GET_ALL_STATE, (uint8_t*)&arg, sizeof(arg), sizeof(*state),
+                                  frame, timeout_ticks)) != RSCP_ERR_OK) {
+        return err;
+    }
+
+    if ((frame->command != RSCP_CMD_GET_ALL_STATE) || (frame->length - 2 < 2)) {
+        return RSCP_ERR_INVALID_ANSWER;
+    }
+
+    // The shutter count must match both the request and the frame length
+    uint8_t count = frame->data[1];
+    if ((count > arg.maxShutters) ||
+        (frame->length - 2 != (int)(sizeof(*state) - sizeof(state->shutters) + count * sizeof(state->shutters[0])))) {
+        return RSCP_ERR_MALFORMED;
+    }
+    memcpy(state, frame->data, frame->length - 2);
+
+    return RSCP_ERR_OK;
+}
+
+#if RSCP_ENABLE_JOB_QUEUE
+
+/**
+ * @brief Sends an action that the slave may run after replying.
+ *
+ * The action is wrapped in RSCP_CMD_SUBMIT_JOB, so only the slave replies
+ * with the job ID and plain actions keep their single status byte.
+ *
+ * @param command The command byte of the type of action to send.
+ * @param data Pointer to the action argument.
+ * @param dataLength Length of the action argument.
+ * @param job Filled with the job ID, RSCP_DEF_JOB_NONE if the slave ran the
+ *            action before replying.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return RSCP error code. RSCP_ERR_NOT_SUPPORTED if the slave has no job queue.
+ */
+RSCP_ErrorType rscpSendActionJob(uint8_t command, uint8_t *data, uint8_t dataLength, uint8_t *job, uint32_t timeout_ticks) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+    uint8_t request[RSCP_MAX_DATA_LENGTH];
+    rscpDeclareFrame(frame);
+
+    *job = RSCP_DEF_JOB_NONE;
+
+    if ((uint32_t)dataLength + 1 > rscpGetMaxDataLength()) {
+        return RSCP_ERR_OVERFLOW;
+    }
+
+    request[0] = command;
+    memcpy(&request[1], data, dataLength);
+
+    if ((err = rscpMasterExchange(RSCP_CMD_SUBMIT_JOB, request, dataLength + 1, sizeof(struct RSCP_Reply_job),
+                                  frame, timeout_ticks)) != RSCP_ERR_OK) {
+        return err;
+    }
+    if (frame->command != RSCP_CMD_SUBMIT_JOB) {
+        return RSCP_ERR_INVALID_ANSWER;
+    }
+
+    // A slave that does not know the command answers with a single status
+    if (frame->length - 2 < (int)sizeof(struct RSCP_Reply_job)) {
+        return (RSCP_ErrorType)(int8_t)frame->data[0];
+    }
+
+    const struct RSCP_Reply_job *reply = (const struct RSCP_Reply_job *)frame->data;
+    *job = reply->job;
+
+    return (RSCP_ErrorType)(int8_t)reply->status;
+}
+
+/**
+ * @brief Reads the state of an action queued on the slave.
+ *
+ * @param job The job ID returned by rscpSendActionJob.
+ * @param status Pointer to the status to fill.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpRequestJobStatus(uint8_t job, struct RSCP_Reply_job_status *status, uint32_t timeout_ticks) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+    struct RSCP_Arg_job_status arg = { job };
+    rscpDeclareFrame(frame);
+
+    if ((err = rscpMasterExchange(RSCP_CMD_GET_JOB_STATUS, (uint8_t*)&arg, sizeof(arg), sizeof(*status), frame, timeout_ticks)) != RSCP_ERR_OK) {
+        return err;
+    }
+
+    return rscpMasterFinish(frame, RSCP_CMD_GET_JOB_STATUS, (uint8_t*)status, sizeof(*status));
+}
+
+#endif
+
+#if RSCP_ENABLE_FRAGMENTATION
+
+/**
+ * @brief Sends a payload larger than one frame to the slave.
+ *
+ * The payload is cut into fragments that fill the negotiated frame size. Up
+ * to RSCP_FRAGMENT_WINDOW fragments are sent back to back, the last of them
+ * asking for an acknowledgement, and only the fragments the slave reports
+ * as missing are sent again. Fragment 0 is flagged RSCP_DEF_FRAGMENT_FIRST
+ * until the first acknowledgement, so a slave that missed it still drops
+ * the state of an older transfer with the same ID.
+ *
+ * @param data Pointer to the payload.
+ * @param length Length of the payload in bytes.
+ * @param timeout_ticks The timeout duration in ticks for each acknowledgement.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpSendFragmented(const uint8_t *data, uint32_t length, uint32_t timeout_ticks) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+    uint8_t buffer[RSCP_MAX_DATA_LENGTH];
+    struct RSCP_Arg_fragment *header = (struct RSCP_Arg_fragment *)buffer;
+    uint8_t chunkSize = rscpGetMaxDataLength() - sizeof(*header);
+    uint32_t count = (length + chunkSize - 1) / chunkSize;
+    uint32_t base = 0;
+    uint32_t sent = 0;      // Highest index sent + 1
+    uint8_t bitmap = 0;     // Bit i set if the slave has fragment base + i
+    uint8_t retries = 0;
+    bool acked = false;     // The slave acknowledged this transfer at least once
+    rscpDeclareFrame(frame);
+
+    if (count == 0) {
+        count = 1; // An empty payload is sent as one empty last fragment
+    }
+    if (count > 0xFFFF) {
+        return RSCP_ERR_OVERFLOW;
+    }
+
+    header->transfer = rscpNextTransfer++;
+    header->chunkSize = chunkSize;
+
+    while (base < count) {
+        uint32_t end = (base + RSCP_FRAGMENT_WINDOW < count) ? (base + RSCP_FRAGMENT_WINDOW) : count;
+        uint32_t lastPending = base;
+
+        for (uint32_t i = base; i < end; i++) {
+            if (!(bitmap & (1 << (i - base)))) {
+                lastPending = i;
+            }
+        }
+
+        // Send the missing fragments of the window, the last one asks for an ack
+        for (uint32_t i = base; i <= lastPending; i++) {
+            if (bitmap & (1 << (i - base))) {
+                continue;
+            }
+            uint32_t offset = i * chunkSize;
+            uint8_t payloadLength = (length - offset > chunkSize) ? chunkSize : (uint8_t)(length - offset);
+
+            header->index = (uint16_t)i;
+            header->flags = ((i == count - 1) ? RSCP_DEF_FRAGMENT_LAST : 0) |
+                            ((i == lastPending) ? RSCP_DEF_FRAGMENT_ACK_REQ : 0) |
+                            (((i == 0) && !acked) ? RSCP_DEF_FRAGMENT_FIRST : 0);
+            memcpy(&buffer[sizeof(*header)], &data[offset], payloadLength);
+            if (i + 1 > sent) {
+                sent = i + 1;
+            }
+
+            if (i != lastPending) {
+                err = rscpSendMsg(RSCP_CMD_FRAGMENT, buffer, sizeof(*header) + payloadLength);
+            } else {
+                err = rscpMasterExchange(RSCP_CMD_FRAGMENT, buffer, sizeof(*header) + payloadLength,
+                                         sizeof(struct RSCP_Reply_fragment_ack), frame, timeout_ticks);
+            }
+            if (err != RSCP_ERR_OK) {
+                break;
+            }
+        }
+
+        if (err == RSCP_ERR_TIMEOUT) {
+            if (retries++ >= RSCP_FRAGMENT_MAX_RETRIES) {
+                return err;
+            }
+            continue; // Send the window again
+        }
+        if (err != RSCP_ERR_OK) {
+            return err;
+        }
+
+        if (frame->command != RSCP_CMD_FRAGMENT) {
+            return RSCP_ERR_INVALID_ANSWER;
+        }
+        if (frame->length - 2 == 1) {
+            return (RSCP_ErrorType)(int8_t)frame->data[0]; // The slave could not store a fragment
+        }
+
+        const struct RSCP_Reply_fragment_ack *ack = (const struct RSCP_Reply_fragment_ack *)frame->data;
+        if ((frame->length - 2 < (int)sizeof(*ack)) || (ack->transfer != header->transfer) ||
+            (ack->base < base) || (ack->base > sent)) {
+            return RSCP_ERR_INVALID_ANSWER;
+        }
+        base = ack->base;
+        bitmap = ack->bitmap;
+        retries = 0;
+        acked = true;
+    }
+
+    return RSCP_ERR_OK;
+}
+
+#endif
+
+/**
+ * @brief Returns the largest data length that can be sent to the selected slave.
+ *
+ * It is RSCP_DEF_BASE_DATA_LENGTH until a RSCP_CMD_CPU_QUERY reply reports
+ * that the slave accepts more, up to RSCP_MAX_DATA_LENGTH.
+ *
+ * @return Data length limit in bytes.
+ */
+uint8_t rscpGetMaxDataLength(void) {
+    return *rscpPeerDataLength();
+}
+
+/**
+ * @brief Fills a transaction from the rscpSubmit arguments.
+ *
+ * @param maxDataLength Data length limit negotiated with the target slave.
+ * @return RSCP_ERR_OK, or RSCP_ERR_OVERFLOW if the data does not fit in a frame.
+ */
+static RSCP_ErrorType rscpFillTransaction(struct RSCP_transaction *transaction, uint8_t maxDataLength,
+                                          uint8_t command, const uint8_t *data, uint8_t dataLength,
+                                          uint8_t *reply, uint8_t replyLength, uint32_t timeout_ticks,
+                                          RSCP_CompletionCallback callback, void *context) {
+    if (dataLength > maxDataLength) {
+        return RSCP_ERR_OVERFLOW;
+    }
+
+    transaction->command = command;
+    if ((reply != NULL) && (dataLength == 0)) {
+        transaction->data[0] = 0x00; // Requests carry a dummy byte
+        transaction->dataLength = 1;
+    } else {
+        memcpy(transaction->data, data, dataLength);
+        transaction->dataLength = dataLength;
+    }
+    transaction->reply = reply;
+    transaction->replyLength = replyLength;
+    transaction->timeout_ticks = timeout_ticks;
+    transaction->callback = callback;
+    transaction->context = context;
+    transaction->state = RSCP_ASYNC_STATE_SEND;
+    transaction->attempts = 0;
+    transaction->priority = rscpGetPriority(transaction);
+
+    return RSCP_ERR_OK;
+}
+
+/**
+ * @brief Queues a filled transaction, preempting a data request if urgent.
+ *
+ * An urgent transaction that finds the queue full takes the place of the
+ * newest queued data request. A preempted data request that no longer fits
+ * in the queue is dropped. Dropped requests complete with
+ * RSCP_ERR_TASK_BUFFER_FULL.
+ *
+ * @return RSCP_ERR_OK, or RSCP_ERR_TASK_BUFFER_FULL if the queue is full.
+ */
+static RSCP_ErrorType rscpQueueTransaction(const struct RSCP_transaction *transaction) {
+    RSCP_CompletionCallback droppedCallback[2] = { NULL, NULL };
+    void *droppedContext[2] = { NULL, NULL };
+    bool urgent = (transaction->priority == RSCP_PRIORITY_URGENT);
+
+    if (urgent && (rscpQueueCount >= RSCP_TRANSACTION_QUEUE_SIZE) &&
+        (rscpQueue[rscpQueueCount - 1].priority == RSCP_PRIORITY_LOW)) {
+        // The queue is sorted by priority, so the last entry is the newest data request
+        rscpQueueCount--;
+        droppedCallback[0] = rscpQueue[rscpQueueCount].callback;
+        droppedContext[0] = rscpQueue[rscpQueueCount].context;
+    }
+
+    if (rscpQueueInsert(transaction, false) != RSCP_ERR_OK) {
+        return RSCP_ERR_TASK_BUFFER_FULL;
+    }
+
+    // Data requests are idempotent, so an urgent action may interrupt one. A
+    // late reply to it is dropped, as it does not echo the command of the action.
+    if (urgent && (rscpAsyncFreeSlot() == NULL)) {
+        for (uint8_t i = 0; i < RSCP_ASYNC_SLOTS; i++) {
+            if ((rscpAsync[i].state == RSCP_ASYNC_STATE_RECEIVE) && (rscpAsync[i].reply != NULL)) {
+                rscpAsync[i].state = RSCP_ASYNC_STATE_SEND;
+                if (rscpQueueInsert(&rscpAsync[i], true) != RSCP_ERR_OK) {
+                    droppedCallback[1] = rscpAsync[i].callback;
+                    droppedContext[1] = rscpAsync[i].context;
+                }
+                rscpAsync[i].state = RSCP_ASYNC_STATE_IDLE;
+                break;
+            }
+        }
+    }
+
+    // Last, as a callback may submit again. Not a transport failure, so the
+    // health of the slave is left alone.
+    for (uint8_t i = 0; i < 2; i++) {
+        if (droppedCallback[i] != NULL) {
+            droppedCallback[i](droppedContext[i], RSCP_ERR_TASK_BUFFER_FULL);
+        }
+    }
+
+    return RSCP_ERR_OK;
+}
+
+/**
+ * @brief Queues a transaction to be run by rscpPoll without blocking.
+ *
+ * With a reply buffer the transaction is a data request, otherwise it is an
+ * action and the completion reports the status returned by the slave.
+ * Transactions run by priority: RSCP_DEF_SHUTTER_ACTION_STOP first, then
+ * other actions, then data requests. A stop also preempts a data request
+ * that is waiting for its reply, which is sent again afterwards, and takes
+ * the place of the newest data request when the queue is full.
+ *
+ * @param command The command byte to send.
+ * @param data Pointer to the data to be sent. It is copied, so it may be reused on return.
+ * @param dataLength Length of the data to be sent.
+ * @param reply Pointer to the reply data to be filled, NULL for actions.
+ * @param replyLength Length of the reply data to be filled.
+ * @param timeout_ticks The timeout duration in rscpPoll calls without progress, or
+ *                      the deadline from now on the host clock with RSCP_USE_TIME_CALLBACK.
+ * @param callback Function called with the result, may be NULL.
+ * @param context User pointer passed to the callback.
+ * @return RSCP_ERR_OK if queued, RSCP_ERR_TASK_BUFFER_FULL if the queue is full.
+ */
+RSCP_ErrorType rscpSubmit(uint8_t command, const uint8_t *data, uint8_t dataLength,
+                          uint8_t *reply, uint8_t replyLength, uint32_t timeout_ticks,
+                          RSCP_CompletionCallback callback, void *context) {
+    struct RSCP_transaction transaction;
+    RSCP_ErrorType err;
+
+    if ((err = rscpFillTransaction(&transaction, rscpGetMaxDataLength(), command, data, dataLength,
+                                   reply, replyLength, timeout_ticks, callback, context)) != RSCP_ERR_OK) {
+        return err;
+    }
+#if RSCP_ENABLE_MULTI_SLAVE
+    transaction.slave = NULL;
+#endif
+
+    return rscpQueueTransaction(&transaction);
+}
+
+/**
+ * @brief Advances the asynchronous transactions without waiting.
+ *
+ * Call it from the firmware main loop. Each call that finds no reply bytes
+ * counts as one tick towards the transaction timeouts, unless
+ * RSCP_USE_TIME_CALLBACK measures them on the host clock. With
+ * RSCP_ENABLE_SEQUENCE up to RSCP_MAX_IN_FLIGHT requests are sent before
+ * their replies arrive, and replies are matched by sequence number.
+ *
+ * @return true while transactions are in progress or queued.
+ */
+bool rscpPoll(void) {
+    struct RSCP_transaction *transaction;
+    RSCP_ParseStatus status;
+    bool received = false;
+    bool more;
+
+#if RSCP_ENABLE_MULTI_SLAVE
+    for (uint8_t i = 0; i < rscpSlaveCount; i++) {
+        if (rscpSlaves[i].holdoff > 0) {
+            rscpSlaves[i].holdoff--;
+        }
+    }
+#endif
+
+    // Send queued transactions while there are free slots
+    while ((rscpQueueCount > 0) && ((transaction = rscpAsyncFreeSlot()) != NULL)) {
+#if RSCP_ENABLE_MULTI_SLAVE
+        int16_t next = rscpSchedulerPick();
+#else
+        int16_t next = 0;
+#endif
+        if (next < 0) {
+            break;
+        }
+#if RSCP_ENABLE_SEQUENCE
+        if (!rscpAsyncCanLaunch(&rscpQueue[next])) {
+            break;
+        }
+#endif
+        *transaction = rscpQueue[next];
+        rscpQueueCount--;
+        memmove(&rscpQueue[next], &rscpQueue[next + 1], (rscpQueueCount - next) * sizeof(rscpQueue[0]));
+#if RSCP_ENABLE_MULTI_SLAVE
+        if (transaction->slave != NULL) {
+            rscpLastSlaveIndex = (uint8_t)(transaction->slave - rscpSlaves);
+        }
+#endif
+        rscpAsyncLaunch(transaction);
+    }
+
+    // Take every reply that already arrived
+    while (rscpAsyncReceiving() > 0) {
+        status = rscpRxPump(&more);
+        received |= more;
+        if (status == RSCP_PARSE_FRAME_READY) {
+            if ((transaction = rscpAsyncMatch(&rscpRxParser.frame)) != NULL) {
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+                if (transaction->attempts == 0) {
+#if RSCP_USE_TIME_CALLBACK
+                    rscpRttSample(transaction->rtt, rscpNow() - transaction->sentAt);
+#else
+                    rscpRttSample(transaction->rtt, transaction->elapsed);
+#endif
+                }
+#endif
+                rscpAsyncComplete(transaction, rscpMasterFinish(&rscpRxParser.frame, transaction->command,
+                                                                transaction->reply, transaction->replyLength));
+            }
+        } else if (status == RSCP_PARSE_ERROR) {
+            // A broken reply can only be blamed on a request if it is the only one
+            for (uint8_t i = 0; (i < RSCP_ASYNC_SLOTS) && (rscpAsyncReceiving() == 1); i++) {
+                if (rscpAsync[i].state == RSCP_ASYNC_STATE_RECEIVE) {
+                    rscpAsyncComplete(&rscpAsync[i], rscpRxParser.error);
+                }
+            }
+        } else {
+            break;
+        }
+    }
+
+    for (uint8_t i = 0; i < RSCP_ASYNC_SLOTS; i++) {
+        if (rscpAsync[i].state != RSCP_ASYNC_STATE_RECEIVE) {
+            continue;
+        }
+        if (!rscpAsyncExpired(&rscpAsync[i], received)) {
+            continue;
+        }
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+        // An attempt that waited the caller's whole timeout is not worth repeating
+#if RSCP_USE_TIME_CALLBACK
+        if ((rscpAsync[i].attempts < RSCP_MAX_RETRIES) && !rscpTimeReached(rscpAsync[i].deadline) &&
+            (rscpAsyncTimeout(&rscpAsync[i]) < rscpAsync[i].timeout_ticks)) {
+#else
+        if ((rscpAsync[i].attempts < RSCP_MAX_RETRIES) &&
+            (rscpAsyncTimeout(&rscpAsync[i]) < rscpAsync[i].timeout_ticks)) {
+#endif
+            rscpAsync[i].attempts++;
+            rscpAsync[i].state = RSCP_ASYNC_STATE_SEND;
+            rscpAsyncLaunch(&rscpAsync[i]);
+            continue;
+        }
+#endif
+        rscpAsyncComplete(&rscpAsync[i], RSCP_ERR_TIMEOUT);
+    }
+
+    return (rscpAsyncReceiving() > 0) || (rscpQueueCount > 0);
+}
+
+#if RSCP_ENABLE_MULTI_SLAVE
+
+/**
+ * @brief Registers a slave on the bus.
+ *
+ * @param address Bus address passed to rscpSelectSlaveCallback.
+ * @return Handle of the slave, or NULL if RSCP_MAX_SLAVES are registered.
+ */
+struct RSCP_slave * rscpSlaveRegister(uint8_t address) {
+    if (rscpSlaveCount >= RSCP_MAX_SLAVES) {
+        return NULL;
+    }
+
+    struct RSCP_slave *slave = &rscpSlaves[rscpSlaveCount++];
+    memset(slave, 0, sizeof(*slave));
+    slave->address = address;
+    slave->maxDataLength = RSCP_DEF_BASE_DATA_LENGTH;
+    slave->protocolVersion = RSCP_DEF_PROTOCOL_VERSION_BASE;
+
+    return slave;
+}
+
+/**
+ * @brief Addresses a slave for the following blocking calls.
+ *
+ * @param slave Pointer to the slave.
+ * @return RSCP_ERR_OK, or RSCP_ERR_TX_FAILED if the host could not select it.
+ */
+RSCP_ErrorType rscpSlaveSelect(struct RSCP_slave *slave) {
+    if (rscpSelectSlaveCallback(slave->address) < 0) {
+        return RSCP_ERR_TX_FAILED;
+    }
+    rscpSelectedSlave = slave;
+    return RSCP_ERR_OK;
+}
+
+/**
+ * @brief Queries the capabilities of a slave.
+ *
+ * @param slave Pointer to the slave.
+ * @param timeout_ticks The timeout duration in ticks.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpSlaveDiscover(struct RSCP_slave *slave, uint32_t timeout_ticks) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+
+    if ((err = rscpSlaveSelect(slave)) == RSCP_ERR_OK) {
+        err = rscpRequestData(RSCP_CMD_CPU_QUERY, (uint8_t *)&slave->capabilities,
+                              sizeof(slave->capabilities), timeout_ticks);
+    }
+    if (err == RSCP_ERR_OK) {
+        slave->flags |= RSCP_SLAVE_FLAG_DISCOVERED;
+    }
+    rscpSlaveUpdateHealth(slave, err);
+
+    return err;
+}
+
+/**
+ * @brief Marks a slave as busy so the scheduler skips its transactions.
+ *
+ * Urgent actions are still sent.
+ *
+ * @param slave Pointer to the slave.
+ * @param busy true to skip the slave, false to schedule it again.
+ */
+void rscpSlaveSetBusy(struct RSCP_slave *slave, bool busy) {
+    if (busy) {
+        slave->flags |= RSCP_SLAVE_FLAG_BUSY;
+    } else {
+        slave->flags &= ~RSCP_SLAVE_FLAG_BUSY;
+    }
+}
+
+/**
+ * @brief Queues a transaction for a given slave.
+ *
+ * Same as rscpSubmit, but the slave is selected before sending, its health
+ * is updated with the result, and queued transactions are interleaved fairly
+ * across slaves.
+ *
+ * @param slave Pointer to the slave.
+ * @return RSCP_ERR_OK if queued, RSCP_ERR_TASK_BUFFER_FULL if the queue is full.
+ */
+RSCP_ErrorType rscpSubmitTo(struct RSCP_slave *slave, uint8_t command, const uint8_t *data, uint8_t dataLength,
+                            uint8_t *reply, uint8_t replyLength, uint32_t timeout_ticks,
+                            RSCP_CompletionCallback callback, void *context) {
+    struct RSCP_transaction transaction;
+    RSCP_ErrorType err;
+
+    if ((err = rscpFillTransaction(&transaction, slave->maxDataLength, command, data, dataLength,
+                                   reply, replyLength, timeout_ticks, callback, context)) != RSCP_ERR_OK) {
+        return err;
+    }
+    transaction.slave = slave;
+
+    return rscpQueueTransaction(&transaction);
+}
+
+#endif
+
+#else
+
+/**
+ * @brief Sends a CPU query request to the master.
+ *
+ * @param data Unused request argument.
+ * @param dataLength Unused request argument length.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpGetCPUQuery(uint8_t *data, uint8_t dataLength) {
+    (void)data;
+    (void)dataLength;
+
+    // Fill reply
+    struct RSCP_Reply_cpuquery reply;
+    reply.flags = 0;
+    reply.crcType = RSCP_DEF_CRC_TYPE_MODBUS16;
+    reply.protocolversion = RSCP_DEF_PROTOCOL_VERSION;
+    reply.cpuType = RSCP_CPU_TYPE;
+    reply.swversion = RSCP_DEF_SWVERSION_VERSION;
+    reply.packetMaxLen = RSCP_DEF_PACKET_OVERHEAD + RSCP_MAX_DATA_LENGTH;
+
+    return rscpSendMsg(RSCP_CMD_CPU_QUERY, (uint8_t*)&reply, sizeof(struct RSCP_Reply_cpuquery));
+}
+
+#if RSCP_ENABLE_REPLY_CACHE
+static bool rscpSendCachedReply(uint8_t command, RSCP_ErrorType *err);
+#endif
+
+#if RSCP_ENABLE_CMD_GET_SHUTTER_POSITION
+
+/**
+ * @brief Sends a shutter position request to the master.
+ *
+ * @param data Unused request argument.
+ * @param dataLength Unused request argument length.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpGetShutterPosition(uint8_t *data, uint8_t dataLength) {
+    (void)data;
+    (void)dataLength;
+
+#if RSCP_ENABLE_REPLY_CACHE
+    RSCP_ErrorType err;
+    if (rscpSendCachedReply(RSCP_CMD_GET_SHUTTER_POSITION, &err)) {
+        return err;
+    }
+#endif
+
+    // Fill reply
+    struct RSCP_Reply_rollershutterposition reply;
+    rscpLoadShutterPosition(&reply);
+
+    return rscpSendMsg(RSCP_CMD_GET_SHUTTER_POSITION, (uint8_t*)&reply, sizeof(struct RSCP_Reply_rollershutterposition));
+}
+
+#endif
+
+#if RSCP_ENABLE_CMD_GET_SWITCH_RELAY
+
+/**
+ * @brief Sends a switch relay request to the master.
+ *
+ * @param data Unused request argument.
+ * @param dataLength Unused request argument length.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpGetSwitchRelay(uint8_t *data, uint8_t dataLength) {
+    (void)data;
+    (void)dataLength;
+
+#if RSCP_ENABLE_REPLY_CACHE
+    RSCP_ErrorType err;
+    if (rscpSendCachedReply(RSCP_CMD_GET_SWITCH_RELAY, &err)) {
+        return err;
+    }
+#endif
+
+    // Fill reply
+    struct RSCP_Reply_switchrelay reply;
+    rscpLoadSwitchRelay(&reply);
+    
+    return rscpSendMsg(RSCP_CMD_GET_SWITCH_RELAY, (uint8_t*)&reply, sizeof(struct RSCP_Reply_switchrelay));
+}
+
+#endif
+
+#if RSCP_ENABLE_CMD_GET_SWITCH_BUTTON
+
+/**
+ * @brief Sends a switch button request to the master.
+ *
+ * @param data Unused request argument.
+ * @param dataLength Unused request argument length.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpGetSwitchButton(uint8_t *data, uint8_t dataLength) {
+    (void)data;
+    (void)dataLength;
+
+#if RSCP_ENABLE_REPLY_CACHE
+    RSCP_ErrorType err;
+    if (rscpSendCachedReply(RSCP_CMD_GET_SWITCH_BUTTON, &err)) {
+        return err;
+    }
+#endif
+
+    // Fill reply
+    struct RSCP_Reply_switchbutton reply;
+    rscpLoadSwitchButton(&reply);
+    
+    return rscpSendMsg(RSCP_CMD_GET_SWITCH_BUTTON, (uint8_t*)&reply, sizeof(struct RSCP_Reply_switchbutton));
+}
+
+#endif
+
+#if RSCP_ENABLE_CMD_GET_ALL_STATE
+
+/**
+ * @brief Sends the shutter, relay and button state to the master in one reply.
+ *
+ * The shutters are cut to the number the master can receive, which may be
+ * less than this slave's RSCP_DEF_ALL_STATE_MAX_SHUTTERS.
+ *
+ * @param data Pointer to the optional struct RSCP_Arg_allstate argument.
+ * @param dataLength Length of the argument.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpGetAllState(uint8_t *data, uint8_t dataLength) {
+    uint8_t maxShutters = RSCP_DEF_ALL_STATE_BASE_SHUTTERS;
+
+    if ((dataLength >= sizeof(struct RSCP_Arg_allstate)) && (((struct RSCP_Arg_allstate *)data)->maxShutters != 0)) {
+        maxShutters = ((struct RSCP_Arg_allstate *)data)->maxShutters;
+    }
+    if (maxShutters > RSCP_DEF_ALL_STATE_MAX_SHUTTERS) {
+        maxShutters = RSCP_DEF_ALL_STATE_MAX_SHUTTERS;
+    }
+
+    // Fill reply
+    rscpDeclareReply(replyBuffer, sizeof(struct RSCP_Reply_allstate));
+    struct RSCP_Reply_allstate *reply = (struct RSCP_Reply_allstate *)replyBuffer;
+#if RSCP_USE_ALL_STATE_CALLBACK
+    rscpGetAllStateCallback(reply);
+#else
+    struct RSCP_Reply_switchrelay relay;
+    struct RSCP_Reply_switchbutton button;
+    rscpLoadShutterPosition(&reply->shutters[0]);
+    rscpLoadSwitchRelay(&relay);
+    rscpLoadSwitchButton(&button);
+    reply->shutterCount = 1;
+    reply->flags = ((relay.status == RSCP_DEF_SWITCH_RELAY_ON) ? RSCP_DEF_ALL_STATE_RELAY_ON : 0) |
+                   ((button.status == RSCP_DEF_SWITCH_BUTTON_ON) ? RSCP_DEF_ALL_STATE_BUTTON_ON : 0);
+#endif
+    if (reply->shutterCount > maxShutters) {
+        reply->shutterCount = maxShutters;
+    }
+
+    uint8_t replyLength = sizeof(*reply) - sizeof(reply->shutters) + reply->shutterCount * sizeof(reply->shutters[0]);
+    return rscpSendMsg(RSCP_CMD_GET_ALL_STATE, replyBuffer, replyLength);
+}
+
+#endif
+
+#if RSCP_ENABLE_STATE_STORE
+
+/**
+ * @brief Publishes the state reported by the GET commands.
+ *
+ * Only one context may publish. Each copy is updated while readers are
+ * pointed at the other one, so a reader never waits for the publisher.
+ * Changed items are marked dirty with RSCP_ENABLE_CHANGE_TRACKING, and
+ * their cached replies are rebuilt with RSCP_ENABLE_REPLY_CACHE.
+ *
+ * @param state Pointer to the new state.
+ */
+void rscpPublishState(const struct RSCP_state *state) {
+    const struct RSCP_state *current = &rscpStateCopies[rscpStateSequence & 1];
+    uint8_t mask = 0;
+
+    if (memcmp(&state->shutter, &current->shutter, sizeof(state->shutter)) != 0) {
+        mask |= RSCP_DEF_DIRTY_SHUTTER;
+    }
+    if (memcmp(&state->relay, &current->relay, sizeof(state->relay)) != 0) {
+        mask |= RSCP_DEF_DIRTY_RELAY;
+    }
+    if (memcmp(&state->button, &current->button, sizeof(state->button)) != 0) {
+        mask |= RSCP_DEF_DIRTY_BUTTON;
+    }
+
+    rscpStateSequence++; // Odd, readers use copy 1
+    RSCP_MEMORY_BARRIER();
+    rscpStateCopies[0] = *state;
+    RSCP_MEMORY_BARRIER();
+    rscpStateSequence++; // Even, readers use copy 0
+    RSCP_MEMORY_BARRIER();
+    rscpStateCopies[1] = *state;
+    RSCP_MEMORY_BARRIER();
+
+#if RSCP_ENABLE_CHANGE_TRACKING
+    rscpMarkDirty(mask);
+#elif RSCP_ENABLE_REPLY_CACHE
+    rscpRefreshReplyCache(mask);
+#else
+    (void)mask;
+#endif
+}
+
+/**
+ * @brief Reads a consistent snapshot of the published state.
+ *
+ * Lock-free and safe from interrupts. It retries only if the state was
+ * published while it was being copied.
+ *
+ * @param state Pointer to the snapshot to fill.
+ */
+void rscpReadState(struct RSCP_state *state) {
+    uint8_t sequence;
+
+    do {
+        sequence = rscpStateSequence;
+        RSCP_MEMORY_BARRIER();
+        *state = rscpStateCopies[sequence & 1];
+        RSCP_MEMORY_BARRIER();
+    } while (sequence != rscpStateSequence);
+}
+
+#endif
+
+#if RSCP_ENABLE_REPLY_CACHE
+
+/**
+ * @brief Builds a reply frame into the inactive buffer of a cache entry.
+ *
+ * @param cache Pointer to the cache entry.
+ * @param command The GET command byte.
+ * @param data Pointer to the reply data.
+ * @param dataLength Length of the reply data.
+ */
+static void rscpReplyCacheStore(struct RSCP_reply_cache *cache, uint8_t command, const uint8_t *data, uint8_t dataLength) {
+    uint8_t next = cache->active ^ 1;
+
+    cache->length[next] = rscpBuildMsg(cache->frame[next], command, RSCP_NO_SEQUENCE, data, dataLength);
+#if RSCP_ENABLE_SEQUENCE
+    rscpBuildMsg(cache->sequenced[next], command, 0, data, dataLength);
+#endif
+    cache->active = next; // Single byte write, the frame is complete before it is served
+}
+
+/**
+ * @brief Rebuilds the cached GET replies of the state that changed.
+ *
+ * Call it from the main loop, not from the context that serves the cache.
+ * With RSCP_ENABLE_CHANGE_TRACKING rscpMarkDirty calls it.
+ *
+ * @param mask RSCP_DEF_DIRTY_* bits of the replies to rebuild.
+ */
+void rscpRefreshReplyCache(uint8_t mask) {
+#if RSCP_ENABLE_CMD_GET_SHUTTER_POSITION
+    if (mask & RSCP_DEF_DIRTY_SHUTTER) {
+        struct RSCP_Reply_rollershutterposition reply;
+        rscpLoadShutterPosition(&reply);
+        rscpReplyCacheStore(&rscpShutterCache, RSCP_CMD_GET_SHUTTER_POSITION, (uint8_t*)&reply, sizeof(reply));
+    }
+#endif
+#if RSCP_ENABLE_CMD_GET_SWITCH_RELAY
+    if (mask & RSCP_DEF_DIRTY_RELAY) {
+        struct RSCP_Reply_switchrelay reply;
+        rscpLoadSwitchRelay(&reply);
+        rscpReplyCacheStore(&rscpRelayCache, RSCP_CMD_GET_SWITCH_RELAY, (uint8_t*)&reply, sizeof(reply));
+    }
+#endif
+#if RSCP_ENABLE_CMD_GET_SWITCH_BUTTON
+    if (mask & RSCP_DEF_DIRTY_BUTTON) {
+        struct RSCP_Reply_switchbutton reply;
+        rscpLoadSwitchButton(&reply);
+        rscpReplyCacheStore(&rscpButtonCache, RSCP_CMD_GET_SWITCH_BUTTON, (uint8_t*)&reply, sizeof(reply));
+    }
+#endif
+}
+
+/**
+ * @brief Finds the cache entry of a GET command.
+ *
+ * @param command The GET command byte.
+ * @return Pointer to the entry, NULL if the command has none or its reply
+ *         was not built yet.
+ */
+static struct RSCP_reply_cache * rscpReplyCacheFor(uint8_t command) {
+    struct RSCP_reply_cache *cache;
+
+    switch (command) {
+        case RSCP_CMD_GET_SHUTTER_POSITION:
+            cache = &rscpShutterCache;
+            break;
+        case RSCP_CMD_GET_SWITCH_RELAY:
+            cache = &rscpRelayCache;
+            break;
+        case RSCP_CMD_GET_SWITCH_BUTTON:
+            cache = &rscpButtonCache;
+            break;
+        default:
+            return NULL;
+    }
+
+    return (cache->length[cache->active] != 0) ? cache : NULL;
+}
+
+/**
+ * @brief Gets the ready-to-send reply frame of a GET command.
+ *
+ * Safe to call from the I2C request interrupt. The frame stays valid until
+ * the second refresh of the same reply. It carries no sequence byte.
+ *
+ * @param command The GET command byte.
+ * @param frame Filled with a pointer to the frame.
+ * @param length Filled with the frame length.
+ * @return true if the command has a cached reply.
+ */
+bool rscpGetCachedReply(uint8_t command, const uint8_t **frame, uint8_t *length) {
+    const struct RSCP_reply_cache *cache = rscpReplyCacheFor(command);
+
+    if (cache == NULL) {
+        return false;
+    }
+    uint8_t active = cache->active;
+    *frame = cache->frame[active];
+    *length = cache->length[active];
+
+    return true;
+}
+
+#if RSCP_ENABLE_SEQUENCE
+
+/**
+ * @brief Gets the cached reply frame of a GET command for a sequenced request.
+ *
+ * The sequence byte sits at a fixed offset, so it is patched in place and
+ * the CRC is corrected by the contribution of the changed byte instead of
+ * being computed over the frame again. CRC-16/MODBUS is linear, and that
+ * contribution is the CRC, from 0, of the changed bits followed by the data.
+ *
+ * @param command The GET command byte.
+ * @param sequence Sequence byte of the request.
+ * @param frame Filled with a pointer to the frame.
+ * @param length Filled with the frame length.
+ * @return true if the command has a cached reply.
+ */
+static bool rscpGetCachedSequencedReply(uint8_t command, uint8_t sequence, const uint8_t **frame, uint8_t *length) {
+    struct RSCP_reply_cache *cache = rscpReplyCacheFor(command);
+
+    if (cache == NULL) {
+        return false;
+    }
+    uint8_t active = cache->active;
+    uint8_t *buffer = cache->sequenced[active];
+    uint8_t frameLength = cache->length[active] + 1;
+    uint8_t zero = 0;
+    uint8_t change = buffer[3] ^ sequence;
+    uint16_t delta = rscpCrc16Update(0, &change, 1);
+
+    for (uint8_t index = 4; index < frameLength - 2; index++) {
+        delta = rscpCrc16Update(delta, &zero, 1);
+    }
+    uint16_t crc = ((buffer[frameLength - 2] << 8) | buffer[frameLength - 1]) ^ delta;
+    buffer[3] = sequence;
+    buffer[frameLength - 2] = (uint8_t)(crc >> 8);
+    buffer[frameLength - 1] = (uint8_t)(crc & 0xFF);
+
+    *frame = buffer;
+    *length = frameLength;
+
+    return true;
+}
+
+#endif
+
+/**
+ * @brief Sends or stages the cached reply of a built-in GET command.
+ *
+ * The reply carries the sequence of the request being answered. In
+ * event-driven mode rscpOnRequest reads it straight from the cache.
+ *
+ * @param command The GET command byte.
+ * @param err Filled with the result of sending the reply.
+ * @return true if the command had a cached reply.
+ */
+static bool rscpSendCachedReply(uint8_t command, RSCP_ErrorType *err) {
+    const uint8_t *frame;
+    uint8_t length;
+    bool cached;
+
+#if RSCP_ENABLE_SEQUENCE
+    if (rscpTxSequence != RSCP_NO_SEQUENCE) {
+        cached = rscpGetCachedSequencedReply(command, (uint8_t)rscpTxSequence, &frame, &length);
+    } else {
+        cached = rscpGetCachedReply(command, &frame, &length);
+    }
+#else
+    cached = rscpGetCachedReply(command, &frame, &length);
+#endif
+    if (!cached) {
+        return false;
+    }
+
+#if RSCP_ENABLE_EVENT_DRIVEN
+    rscpStagedFrame = frame;
+    rscpStagedIndex = 0;
+    rscpStagedLength = length;
+    *err = RSCP_ERR_OK;
+#else
+    *err = rscpSendFrame(frame, length);
+#endif
+
+    return true;
+}
+
+#endif
+
+#if RSCP_ENABLE_CHANGE_TRACKING
+
+/**
+ * @brief Updates the dirty bits and drives the attention signal.
+ *
+ * The signal is asserted while some dirty item was not reported to the
+ * master yet. Call it within RSCP_ENTER_CRITICAL.
+ *
+ * @param dirty New RSCP_DEF_DIRTY_* bits.
+ * @param reported New bits of dirty sent in the last reply.
+ */
+static void rscpSetDirty(uint8_t dirty, uint8_t reported) {
+    bool wasPending = ((rscpDirty & ~rscpDirtyReported) != 0);
+    bool pending = ((dirty & ~reported) != 0);
+
+    rscpDirty = dirty;
+    rscpDirtyReported = reported;
+    if (pending != wasPending) {
+        rscpAttentionCallback(pending);
+    }
+}
+
+/**
+ * @brief Flags state as changed and raises the attention signal.
+ *
+ * Call it from the main loop. With RSCP_ENABLE_EVENT_DRIVEN the dirty bits
+ * are updated within RSCP_ENTER_CRITICAL, as rscpOnReceive clears them.
+ *
+ * @param mask RSCP_DEF_DIRTY_* bits of the state that changed.
+ */
+void rscpMarkDirty(uint8_t mask) {
+#if RSCP_ENABLE_REPLY_CACHE
+    rscpRefreshReplyCache(mask); // Before the master is told to read it
+#endif
+
+    // A reported item that changed again is not cleared by the acknowledgement
+    RSCP_ENTER_CRITICAL();
+    rscpSetDirty(rscpDirty | mask, rscpDirtyReported & ~mask);
+    RSCP_EXIT_CRITICAL();
+}
+
+/**
+ * @brief Samples the GET callbacks and flags the state that changed.
+ *
+ * Hosts that do not report changes with rscpMarkDirty call this from their
+ * main loop instead.
+ */
+void rscpPollStateChanges(void) {
+    struct RSCP_Reply_rollershutterposition shutter;
+    struct RSCP_Reply_switchrelay relay;
+    struct RSCP_Reply_switchbutton button;
+    uint8_t mask = 0;
+
+    rscpLoadShutterPosition(&shutter);
+    rscpLoadSwitchRelay(&relay);
+    rscpLoadSwitchButton(&button);
+
+    if (memcmp(&shutter, &rscpLastShutter, sizeof(shutter)) != 0) {
+        rscpLastShutter = shutter;
+        mask |= RSCP_DEF_DIRTY_SHUTTER;
+    }
+    if (memcmp(&relay, &rscpLastRelay, sizeof(relay)) != 0) {
+        rscpLastRelay = relay;
+        mask |= RSCP_DEF_DIRTY_RELAY;
+    }
+    if (memcmp(&button, &rscpLastButton, sizeof(button)) != 0) {
+        rscpLastButton = button;
+        mask |= RSCP_DEF_DIRTY_BUTTON;
+    }
+
+    rscpMarkDirty(mask);
+}
+
+/**
+ * @brief Applies the acknowledgement of a request and takes the items to report.
+ *
+ * @param ack The ack byte of struct RSCP_Arg_changes, 0 if there is none.
+ * @return RSCP_DEF_DIRTY_* bits of the items to send.
+ */
+static uint8_t rscpTakeChanges(uint8_t ack) {
+    RSCP_ENTER_CRITICAL();
+    uint8_t dirty = rscpDirty;
+    if (ack & RSCP_DEF_CHANGES_ACK) {
+        dirty &= ~(ack & rscpDirtyReported);
+    }
+    rscpSetDirty(dirty, dirty);
+    RSCP_EXIT_CRITICAL();
+
+    return dirty;
+}
+
+/**
+ * @brief Records the outcome of sending the changes.
+ *
+ * @param ack The ack byte of struct RSCP_Arg_changes, 0 if there is none.
+ * @param err Result of sending the reply.
+ */
+static void rscpChangesSent(uint8_t ack, RSCP_ErrorType err) {
+    RSCP_ENTER_CRITICAL();
+    if (err != RSCP_ERR_OK) {
+        rscpSetDirty(rscpDirty, 0); // Nothing was reported
+    } else if (!(ack & RSCP_DEF_CHANGES_ACK)) {
+        rscpSetDirty(rscpDirty & ~rscpDirtyReported, 0);
+    }
+    RSCP_EXIT_CRITICAL();
+}
+
+/**
+ * @brief Sends the changed state to the master.
+ *
+ * Items are cleared once the master acknowledges them with its next
+ * request, so a lost reply is sent again. Masters that do not acknowledge
+ * have the items cleared as soon as the reply is sent.
+ *
+ * @param data Pointer to the optional struct RSCP_Arg_changes argument.
+ * @param dataLength Length of the argument.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpGetChanges(uint8_t *data, uint8_t dataLength) {
+    RSCP_ErrorType err;
+    rscpDeclareReply(reply, sizeof(struct RSCP_Reply_changes));
+    uint8_t replyLength = 0;
+    uint8_t ack = (dataLength >= sizeof(struct RSCP_Arg_changes)) ? ((struct RSCP_Arg_changes *)data)->ack : 0;
+    uint8_t dirty = rscpTakeChanges(ack);
+
+    // Fill reply with the dirty items only
+    reply[replyLength++] = dirty;
+    if (dirty & RSCP_DEF_DIRTY_SHUTTER) {
+        rscpLoadShutterPosition((struct RSCP_Reply_rollershutterposition *)&reply[replyLength]);
+        replyLength += sizeof(struct RSCP_Reply_rollershutterposition);
+    }
+    if (dirty & RSCP_DEF_DIRTY_RELAY) {
+        rscpLoadSwitchRelay((struct RSCP_Reply_switchrelay *)&reply[replyLength]);
+        replyLength += sizeof(struct RSCP_Reply_switchrelay);
+    }
+    if (dirty & RSCP_DEF_DIRTY_BUTTON) {
+        rscpLoadSwitchButton((struct RSCP_Reply_switchbutton *)&reply[replyLength]);
+        replyLength += sizeof(struct RSCP_Reply_switchbutton);
+    }
+
+    err = rscpSendMsg(RSCP_CMD_GET_CHANGES, reply, replyLength);
+    rscpChangesSent(ack, err);
+
+    return err;
+}
+
+#endif
+
+/**
+ * @brief Sends an answer to the master.
+ *
+ * @param command The command byte to respond to.
+ * @param errorCode The error code to send.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpSendFail(uint8_t command, uint8_t errorCode) {
+
+    // Fill reply
+    uint8_t data [] = { errorCode };
+    
+    return rscpSendMsg(command, (uint8_t*)&data, sizeof(data));
+}
+
+#if RSCP_ENABLE_CMD_SET_SHUTTER_ACTION
+
+/**
+ * @brief Passes a shutter action to the host.
+ *
+ * @param data Pointer to the struct RSCP_Arg_rollershutter argument.
+ * @param dataLength Length of the argument.
+ * @return RSCP error code to report to the master.
+ */
+RSCP_ErrorType rscpSetShutterAction(uint8_t *data, uint8_t dataLength) {
+    (void)dataLength;
+
+    return rscpSetShutterActionCallback((struct RSCP_Arg_rollershutter *)data);
+}
+
+#endif
+
+#if RSCP_ENABLE_CMD_SET_SHUTTER_GROUP_ACTION
+
+/**
+ * @brief Applies one action to every shutter selected in a group mask.
+ *
+ * Without a group callback the shutters are started one after the other
+ * in the same pass, so they move together. All selected shutters are
+ * attempted even if one of them fails.
+ *
+ * @param data Pointer to the struct RSCP_Arg_rollershutter_group argument.
+ * @param dataLength Length of the argument.
+ * @return RSCP_ERR_OK, or the first error returned by the host.
+ */
+RSCP_ErrorType rscpSetShutterGroupAction(uint8_t *data, uint8_t dataLength) {
+    struct RSCP_Arg_rollershutter_group *arg = (struct RSCP_Arg_rollershutter_group *)data;
+
+    (void)dataLength;
+
+#if RSCP_USE_GROUP_ACTION_CALLBACK
+    return rscpSetShutterGroupActionCallback(arg);
+#else
+    RSCP_ErrorType result = RSCP_ERR_OK;
+    struct RSCP_Arg_rollershutter single;
+    uint32_t mask = arg->shutterMask;
+
+    single.action = arg->action;
+    single.retries = arg->retries;
+
+    for (uint8_t shutter = 0; mask != 0; shutter++, mask >>= 1) {
+        if (!(mask & 0x01)) {
+            continue;
+        }
+        single.shutter = shutter;
+        RSCP_ErrorType err = rscpSetShutterActionCallback(&single);
+        if ((err != RSCP_ERR_OK) && (result == RSCP_ERR_OK)) {
+            result = err;
+        }
+    }
+
+    return result;
+#endif
+}
+
+#endif
+
+#if RSCP_ENABLE_CMD_SET_SHUTTER_POSITION
+
+/**
+ * @brief Passes a shutter position to the host.
+ *
+ * @param data Pointer to the struct RSCP_Arg_rollershutterposition argument.
+ * @param dataLength Length of the argument.
+ * @return RSCP error code to report to the master.
+ */
+RSCP_ErrorType rscpSetShutterPosition(uint8_t *data, uint8_t dataLength) {
+    (void)dataLength;
+
+    return rscpSetShutterPositionCallback((struct RSCP_Arg_rollershutterposition *)data);
+}
+
+#endif
+
+#if RSCP_ENABLE_CMD_SET_SHUTTER_POSITIONS
+
+/**
+ * @brief Sets the position of every shutter listed in an array.
+ *
+ * Without a positions callback the entries are passed one by one to
+ * rscpSetShutterPositionCallback. All entries are attempted even if one of
+ * them fails.
+ *
+ * @param data Pointer to the shutter/position pairs.
+ * @param dataLength Length of the pairs in bytes.
+ * @return RSCP_ERR_OK, or the first error returned by the host.
+ */
+RSCP_ErrorType rscpSetShutterPositions(uint8_t *data, uint8_t dataLength) {
+    struct RSCP_Arg_rollershutterposition *positions = (struct RSCP_Arg_rollershutterposition *)data;
+    uint8_t count = dataLength / sizeof(struct RSCP_Arg_rollershutterposition);
+
+    if (dataLength % sizeof(struct RSCP_Arg_rollershutterposition) != 0) {
+        return RSCP_ERR_MALFORMED;
+    }
+
+#if RSCP_USE_MULTI_POSITION_CALLBACK
+    return rscpSetShutterPositionsCallback(positions, count);
+#else
+    RSCP_ErrorType result = RSCP_ERR_OK;
+
+    for (uint8_t i = 0; i < count; i++) {
+        RSCP_ErrorType err = rscpSetShutterPositionCallback(&positions[i]);
+        if ((err != RSCP_ERR_OK) && (result == RSCP_ERR_OK)) {
+            result = err;
+        }
+    }
+
+    return result;
+#endif
+}
 
-//---[ Types ]------------------------------------------------------------------
+#endif
 
-//---[ Private Variables ]------------------------------------------------------
+#if RSCP_ENABLE_CMD_SET_SWITCH_RELAY
 
-//---[ Public Variables ]-------------------------------------------------------
+/**
+ * @brief Passes a switch relay status to the host.
+ *
+ * @param data Pointer to the struct RSCP_Arg_switchrelay argument.
+ * @param dataLength Length of the argument.
+ * @return RSCP error code to report to the master.
+ */
+RSCP_ErrorType rscpSetSwitchRelay(uint8_t *data, uint8_t dataLength) {
+    (void)dataLength;
 
-//---[ Private Functions ]------------------------------------------------------
+    return rscpSetSwitchRelayCallback((struct RSCP_Arg_switchrelay *)data);
+}
 
-//---[ Public Functions ]-------------------------------------------------------
+#endif
+
+#if RSCP_ENABLE_CMD_SET_BUZZER_ACTION
 
 /**
- * @brief Blocking function to get a byte from the receive buffer.
+ * @brief Passes a buzzer action to the host.
  *
- * @param readByte Pointer to the variable to store the received byte.
- * @param timeout_ticks The timeout duration in ticks.
- * @return 0 on success, -1 on timeout.
+ * @param data Pointer to the struct RSCP_Arg_buzzer_action argument.
+ * @param dataLength Length of the argument.
+ * @return RSCP error code to report to the master.
  */
-int32_t rscpGetRxByteBlocking(uint8_t *readByte, uint32_t timeout_ticks) {
-    while (rscpGetRxByteCallback(readByte) < 0) {
-        if (timeout_ticks-- == 0) {
-            return -1;
-        }
-        rscpRxWaitingCallback();
-    }
-    return 0;
+RSCP_ErrorType rscpSetBuzzerAction(uint8_t *data, uint8_t dataLength) {
+    (void)dataLength;
+
+    return rscpSetBuzzerActionCallback((struct RSCP_Arg_buzzer_action *)data);
 }
 
+#endif
+
+#if RSCP_ENABLE_CMD_BATCH
+
+RSCP_ErrorType rscpExecuteAction(uint8_t command, uint8_t *data, uint8_t dataLength);
+
 /**
- * @brief Receives an RSCP message.
+ * @brief Runs every sub-command of a batch and replies with their results.
  *
- * @param frame Pointer to the RSCP frame to be filled.
- * @param timeout_ticks The timeout duration in ticks.
+ * Sub-commands run in order. A truncated sub-command ends the batch with
+ * RSCP_ERR_MALFORMED as its result. They only report a status and send
+ * nothing, so the results can be collected where the reply is built.
+ *
+ * @param data Pointer to the sub-commands.
+ * @param dataLength Length of the sub-commands in bytes.
  * @return RSCP error code.
  */
-RSCP_ErrorType rscpGetMsg(struct RSCP_frame *frame, uint32_t timeout_ticks) {
-    uint32_t bufferIndex = 0;
-    uint8_t rscpRxStatus = 0;
-    uint8_t readByte;
-    while (bufferIndex < sizeof(frame->data)) {
-        if (rscpGetRxByteBlocking(&readByte, timeout_ticks) < 0) {
-            return RSCP_ERR_TIMEOUT;
-        }
-        switch (rscpRxStatus) {
-            case 0: // Waiting for length byte
-                if (readByte != RSCP_PREAMBLE_BYTE) {
-                    frame->length = readByte;
-                    rscpRxStatus = 1;
-                }
-                break;
-            case 1: // Waiting for command byte
-                frame->command = readByte;
-                if( frame->length > 2) {
-                    rscpRxStatus = 2;   // Data bytes will follow, request them
-                }else{
-                    rscpRxStatus = 3;   // No data bytes will follow, go to CRC
-                }
-                break;
-            case 2: // Waiting for data bytes
-                frame->data[bufferIndex++] = readByte;
-                // Retrieve CRC by the current buffer index
-                if (bufferIndex >= (uint32_t)(frame->length - sizeof(frame->crc))) {
-                    rscpRxStatus = 3;
-                }
-                break;
-            case 3: // Waiting for CRC high byte
-                frame->crc = (readByte << 8);
-                rscpRxStatus = 4;
-                break;
-            case 4: // Waiting for CRC low byte
-                frame->crc |= readByte;
-                return RSCP_ERR_OK;
+RSCP_ErrorType rscpHandleBatch(uint8_t *data, uint8_t dataLength) {
+    rscpDeclareReply(results, RSCP_MAX_DATA_LENGTH / RSCP_DEF_BATCH_HEADER_SIZE);
+    uint8_t resultCount = 0;
+    uint8_t index = 0;
+
+    while (index < dataLength) {
+        uint8_t *entry = &data[index];
+        if ((index + RSCP_DEF_BATCH_HEADER_SIZE > dataLength) ||
+            (index + RSCP_DEF_BATCH_HEADER_SIZE + entry[1] > dataLength)) {
+            results[resultCount++] = (uint8_t)RSCP_ERR_MALFORMED;
+            break;
         }
+        results[resultCount++] = (uint8_t)rscpExecuteAction(entry[0], &entry[RSCP_DEF_BATCH_HEADER_SIZE], entry[1]);
+        index += RSCP_DEF_BATCH_HEADER_SIZE + entry[1];
     }
-    return RSCP_ERR_OVERFLOW;
+
+    return rscpSendMsg(RSCP_CMD_BATCH, results, resultCount);
 }
 
+#endif
+
+#if RSCP_ENABLE_FRAGMENTATION
+
 /**
- * @brief Sends an RSCP message.
- * 
- * @param command This is the command byte to send.
- * @param data Pointer to the data to be sent.
- * @param dataLength Length of the data to be sent.
- * @return RSCP error code. 
+ * @brief Stores a received fragment and acknowledges it if requested.
+ *
+ * Fragments may arrive in any order within the window. Duplicates and
+ * fragments past the window are dropped, the master sends them again. A
+ * fragment flagged RSCP_DEF_FRAGMENT_FIRST restarts the reassembly, even for
+ * the transfer ID being received, as a restarted master reuses its IDs.
+ *
+ * @param data Pointer to the fragment header and payload.
+ * @param dataLength Length of the fragment in bytes.
+ * @return RSCP error code.
  */
-RSCP_ErrorType rscpSendMsg(uint8_t command, uint8_t* data, uint8_t dataLength) {
-    uint32_t txBufferIndex = 0;
-    uint8_t txBuffer[RSCP_MAX_TX_BUFFER_SIZE];
+RSCP_ErrorType rscpHandleFragment(uint8_t *data, uint8_t dataLength) {
+    struct RSCP_fragment_rx *rx = &rscpFragmentRx;
+    const struct RSCP_Arg_fragment *header = (const struct RSCP_Arg_fragment *)data;
+    uint8_t length = dataLength - sizeof(*header);
+
+    if ((header->chunkSize == 0) || (length > header->chunkSize)) {
+        return rscpSendFail(RSCP_CMD_FRAGMENT, (uint8_t)RSCP_ERR_MALFORMED);
+    }
 
-    // Fill txBuffer
-    txBuffer[txBufferIndex++] = RSCP_PREAMBLE_BYTE;
-    txBuffer[txBufferIndex++] = 2 + dataLength;
-    txBuffer[txBufferIndex++] = command;
+    if (!rx->started || (header->transfer != rx->transfer) || (header->flags & RSCP_DEF_FRAGMENT_FIRST)) {
+        memset(rx, 0, sizeof(*rx));
+        rx->started = true;
+        rx->transfer = header->transfer;
+        rx->chunkSize = header->chunkSize;
+        rx->last = -1;
+    }
 
-    memcpy(&txBuffer[txBufferIndex], data, dataLength);
-    txBufferIndex += dataLength;
+    // Offsets are index * chunkSize, a different size would overwrite stored data
+    if (header->chunkSize != rx->chunkSize) {
+        return rscpSendFail(RSCP_CMD_FRAGMENT, (uint8_t)RSCP_ERR_MALFORMED);
+    }
 
-    uint16_t crc = rscpGetCrcCallback(&txBuffer[1], txBufferIndex - 1);
-    txBuffer[txBufferIndex++] = (crc >> 8) & 0xFF;
-    txBuffer[txBufferIndex++] = (crc & 0xFF);
+    uint16_t index = header->index;
+    if ((index >= rx->base) && (index - rx->base < RSCP_FRAGMENT_WINDOW) &&
+        !(rx->bitmap & (1 << (index - rx->base)))) {
+        uint32_t offset = (uint32_t)index * header->chunkSize;
+        RSCP_ErrorType err = rscpFragmentWriteCallback(rx->transfer, offset, &data[sizeof(*header)], length);
 
-    if (rscpSendSlotCallback(txBuffer, txBufferIndex) < 0) {
-        return RSCP_ERR_TX_FAILED;
+        if (err != RSCP_ERR_OK) {
+            rx->error = err;
+        } else {
+            rx->bitmap |= 1 << (index - rx->base);
+            if (header->flags & RSCP_DEF_FRAGMENT_LAST) {
+                rx->last = index;
+                rx->length = offset + length;
+            }
+            // Slide the window over the fragments received in order
+            while (rx->bitmap & 0x01) {
+                rx->bitmap >>= 1;
+                rx->base++;
+            }
+            if (!rx->complete && (rx->last >= 0) && (rx->base > rx->last)) {
+                rx->complete = true;
+                rscpFragmentCompleteCallback(rx->transfer, rx->length);
+            }
+        }
     }
 
-    return RSCP_ERR_OK;
+    if (!(header->flags & RSCP_DEF_FRAGMENT_ACK_REQ)) {
+        return RSCP_ERR_OK; // The master does not read a reply
+    }
+    if (rx->error != RSCP_ERR_OK) {
+        RSCP_ErrorType err = rx->error;
+        rx->error = RSCP_ERR_OK;
+        return rscpSendFail(RSCP_CMD_FRAGMENT, (uint8_t)err);
+    }
+
+    struct RSCP_Reply_fragment_ack ack;
+    ack.transfer = rx->transfer;
+    ack.base = rx->base;
+    ack.bitmap = rx->bitmap;
+
+    return rscpSendMsg(RSCP_CMD_FRAGMENT, (uint8_t *)&ack, sizeof(ack));
 }
 
-#if RSCP_DEVICE_IS_MASTER
+#endif
+
+#if RSCP_ENABLE_JOB_QUEUE
 
 /**
- * @brief Sends a data request and receives the reply from the slave.
- * 
- * @param command command byte of the type of data to request.
- * @param reply Pointer to the reply data that is to be filled.
- * @param replyLength Length of the reply data to be filled.
- * @param timeout_ticks The timeout duration in ticks.
- * @return RSCP_ErrorType 
+ * @brief Queues an action to run from rscpProcessJobs.
+ *
+ * The oldest finished job is overwritten, pending jobs never are.
+ *
+ * @param entry Command table entry of the action.
+ * @param data Pointer to the action argument, copied into the job.
+ * @param dataLength Length of the action argument.
+ * @param job Filled with the job ID.
+ * @return RSCP_ERR_OK, or RSCP_ERR_TASK_BUFFER_FULL if every job is pending.
  */
-RSCP_ErrorType rscpRequestData(uint8_t command, uint8_t * reply, uint8_t replyLength, uint32_t timeout_ticks) {
-    RSCP_ErrorType err = RSCP_ERR_OK;
+static RSCP_ErrorType rscpJobSubmit(const struct RSCP_command *entry, uint8_t *data, uint8_t dataLength, uint8_t *job) {
+    RSCP_ErrorType err = RSCP_ERR_TASK_BUFFER_FULL;
 
-    uint8_t data [] = { 0x00 }; // No data
+    // rscpProcessJobs may run in between when this is called from rscpOnReceive
+    RSCP_ENTER_CRITICAL();
+    if (rscpJobPending < RSCP_JOB_QUEUE_SIZE) {
+        struct RSCP_job *slot = &rscpJobs[(rscpJobHead + rscpJobPending) % RSCP_JOB_QUEUE_SIZE];
+        if (++rscpLastJob == RSCP_DEF_JOB_NONE) {
+            rscpLastJob++;
+        }
+        slot->id = rscpLastJob;
+        slot->state = RSCP_DEF_JOB_STATE_PENDING;
+        slot->result = (uint8_t)RSCP_ERR_OK;
+        slot->handler = entry->handler;
+        slot->dataLength = dataLength;
+        memcpy(slot->data, data, dataLength);
+        rscpJobPending++;
 
-    if ( (err = rscpSendMsg(command, (uint8_t*)&data[0], sizeof(data))) != RSCP_ERR_OK) {
-        return err;
+        *job = slot->id;
+        err = RSCP_ERR_OK;
     }
+    RSCP_EXIT_CRITICAL();
 
-    struct RSCP_frame frame;
-    uint32_t rxBufferMaxLength = 1 + sizeof(frame.length) + sizeof(frame.command) + replyLength + sizeof(frame.crc);
+    return err;
+}
 
-    if (rscpRequestSlotCallback(rxBufferMaxLength) < 0) {
-        return RSCP_ERR_REQUEST_FAILED;
-    }
+/**
+ * @brief Runs every queued action.
+ *
+ * Call it from the main loop. The action runs outside the critical section,
+ * its slot is not reused while it is still counted as pending.
+ *
+ * @return Number of actions that ran.
+ */
+uint8_t rscpProcessJobs(void) {
+    uint8_t count = 0;
 
-    if ((err = rscpGetMsg(&frame, timeout_ticks)) != RSCP_ERR_OK) {
-        return err;
-    }
+    while (rscpJobPending > 0) {
+        struct RSCP_job *job = &rscpJobs[rscpJobHead];
+        RSCP_ErrorType result = job->handler(job->data, job->dataLength);
 
-    if (rscpGetCrcCallback(((uint8_t *)&frame), frame.length) != frame.crc) {
-        return RSCP_ERR_MALFORMED;
+        RSCP_ENTER_CRITICAL();
+        job->result = (uint8_t)result;
+        job->state = RSCP_DEF_JOB_STATE_DONE;
+        rscpJobHead = (rscpJobHead + 1) % RSCP_JOB_QUEUE_SIZE;
+        rscpJobPending--;
+        RSCP_EXIT_CRITICAL();
+        count++;
     }
 
-    if (frame.command != command) {
-        return RSCP_ERR_INVALID_ANSWER;
-    }
+    return count;
+}
+
+/**
+ * @brief Sends the state of a queued action to the master.
+ *
+ * @param data Pointer to the struct RSCP_Arg_job_status argument.
+ * @param dataLength Length of the argument.
+ * @return RSCP error code.
+ */
+RSCP_ErrorType rscpGetJobStatus(uint8_t *data, uint8_t dataLength) {
+    struct RSCP_Reply_job_status reply;
+
+    (void)dataLength;
 
-    for(uint32_t i = 0; i < replyLength; i++) {
-        reply[i] = frame.data[i];
+    // Fill reply
+    reply.job = ((struct RSCP_Arg_job_status *)data)->job;
+    reply.state = RSCP_DEF_JOB_STATE_UNKNOWN;
+    reply.result = (uint8_t)RSCP_ERR_OK;
+    for (uint8_t i = 0; i < RSCP_JOB_QUEUE_SIZE; i++) {
+        if ((rscpJobs[i].state != RSCP_DEF_JOB_STATE_UNKNOWN) && (rscpJobs[i].id == reply.job)) {
+            reply.state = rscpJobs[i].state;
+            reply.result = rscpJobs[i].result;
+            break;
+        }
     }
 
-    return err;
+    return rscpSendMsg(RSCP_CMD_GET_JOB_STATUS, (uint8_t*)&reply, sizeof(reply));
 }
 
+static RSCP_ErrorType rscpFindCommand(uint8_t command, uint8_t dataLength, struct RSCP_command *entry);
+
 /**
- * @brief Sends a command action and receives the reply.
- * 
- * @param command The command byte of the type of action to send.
- * @param reply Pointer to the action argument.
- * @param timeout_ticks The timeout duration in ticks.
+ * @brief Queues the wrapped action and replies with its job ID.
+ *
+ * Actions that are not queued run before replying, with RSCP_DEF_JOB_NONE as
+ * their job ID. The reply is always a struct RSCP_Reply_job.
+ *
+ * @param data Pointer to the action command byte, followed by its argument.
+ * @param dataLength Length of the command byte and argument.
  * @return RSCP error code.
  */
-RSCP_ErrorType rscpSendAction(uint8_t command, uint8_t *data, uint8_t dataLength, uint32_t timeout_ticks) {
-    RSCP_ErrorType err = RSCP_ERR_OK;
+RSCP_ErrorType rscpSubmitJob(uint8_t *data, uint8_t dataLength) {
+    struct RSCP_Reply_job reply = { (uint8_t)RSCP_ERR_OK, RSCP_DEF_JOB_NONE };
+    struct RSCP_command entry;
+    RSCP_ErrorType err;
 
-    if ( (err = rscpSendMsg(command, (uint8_t*)&data[0], dataLength)) != RSCP_ERR_OK) {
-        return err;
+    if ((err = rscpFindCommand(data[0], dataLength - 1, &entry)) == RSCP_ERR_OK) {
+        if (entry.replyType == RSCP_REPLY_DATA) {
+            err = RSCP_ERR_NOT_SUPPORTED;
+        } else if (entry.replyType == RSCP_REPLY_JOB) {
+            err = rscpJobSubmit(&entry, &data[1], dataLength - 1, &reply.job);
+        } else {
+            err = entry.handler(&data[1], dataLength - 1);
+        }
     }
+    reply.status = (uint8_t)err;
 
-    struct RSCP_frame frame;
-    uint32_t rxBufferMaxLength = 1 + sizeof(frame.length) + sizeof(frame.command) + 1 + sizeof(frame.crc);
+    return rscpSendMsg(RSCP_CMD_SUBMIT_JOB, (uint8_t*)&reply, sizeof(reply));
+}
 
-    if (rscpRequestSlotCallback(rxBufferMaxLength) < 0) {
-        return RSCP_ERR_REQUEST_FAILED;
+#endif
+
+// Slave commands. Host entries come first so they can replace a built-in.
+static const struct RSCP_command rscpCommands[] RSCP_PROGMEM = {
+    RSCP_HOST_COMMAND_TABLE
+    RSCP_COMMAND(RSCP_CMD_CPU_QUERY, 0, RSCP_DEF_REQUEST_MAX_LENGTH, RSCP_REPLY_DATA, rscpGetCPUQuery)
+#if RSCP_ENABLE_CMD_SET_SHUTTER_ACTION
+    RSCP_COMMAND(RSCP_CMD_SET_SHUTTER_ACTION, sizeof(struct RSCP_Arg_rollershutter),
+                 sizeof(struct RSCP_Arg_rollershutter), RSCP_REPLY_ACTION, rscpSetShutterAction)
+#endif
+#if RSCP_ENABLE_CMD_SET_SHUTTER_GROUP_ACTION
+    RSCP_COMMAND(RSCP_CMD_SET_SHUTTER_GROUP_ACTION, sizeof(struct RSCP_Arg_rollershutter_group),
+                 sizeof(struct RSCP_Arg_rollershutter_group), RSCP_REPLY_ACTION, rscpSetShutterGroupAction)
+#endif
+#if RSCP_ENABLE_CMD_SET_SHUTTER_POSITION
+    RSCP_COMMAND(RSCP_CMD_SET_SHUTTER_POSITION, sizeof(struct RSCP_Arg_rollershutterposition),
+                 sizeof(struct RSCP_Arg_rollershutterposition), RSCP_REPLY_ACTION, rscpSetShutterPosition)
+#endif
+#if RSCP_ENABLE_CMD_SET_SHUTTER_POSITIONS
+    RSCP_COMMAND(RSCP_CMD_SET_SHUTTER_POSITIONS, sizeof(struct RSCP_Arg_rollershutterposition),
+                 RSCP_MAX_DATA_LENGTH, RSCP_REPLY_ACTION, rscpSetShutterPositions)
+#endif
+#if RSCP_ENABLE_CMD_GET_SHUTTER_POSITION
+    RSCP_COMMAND(RSCP_CMD_GET_SHUTTER_POSITION, 0, RSCP_DEF_REQUEST_MAX_LENGTH, RSCP_REPLY_DATA, rscpGetShutterPosition)
+#endif
+#if RSCP_ENABLE_CMD_SET_SWITCH_RELAY
+    RSCP_COMMAND(RSCP_CMD_SET_SWITCH_RELAY, sizeof(struct RSCP_Arg_switchrelay),
+                 sizeof(struct RSCP_Arg_switchrelay), RSCP_REPLY_ACTION, rscpSetSwitchRelay)
+#endif
+#if RSCP_ENABLE_CMD_GET_SWITCH_RELAY
+    RSCP_COMMAND(RSCP_CMD_GET_SWITCH_RELAY, 0, RSCP_DEF_REQUEST_MAX_LENGTH, RSCP_REPLY_DATA, rscpGetSwitchRelay)
+#endif
+#if RSCP_ENABLE_CMD_GET_SWITCH_BUTTON
+    RSCP_COMMAND(RSCP_CMD_GET_SWITCH_BUTTON, 0, RSCP_DEF_REQUEST_MAX_LENGTH, RSCP_REPLY_DATA, rscpGetSwitchButton)
+#endif
+#if RSCP_ENABLE_CMD_SET_BUZZER_ACTION
+    RSCP_COMMAND(RSCP_CMD_SET_BUZZER_ACTION, sizeof(struct RSCP_Arg_buzzer_action),
+                 sizeof(struct RSCP_Arg_buzzer_action), RSCP_REPLY_ACTION, rscpSetBuzzerAction)
+#endif
+#if RSCP_ENABLE_CMD_BATCH
+    RSCP_COMMAND(RSCP_CMD_BATCH, 0, RSCP_MAX_DATA_LENGTH, RSCP_REPLY_DATA, rscpHandleBatch)
+#endif
+#if RSCP_ENABLE_CMD_GET_ALL_STATE
+    RSCP_COMMAND(RSCP_CMD_GET_ALL_STATE, 0, RSCP_DEF_REQUEST_MAX_LENGTH, RSCP_REPLY_DATA, rscpGetAllState)
+#endif
+#if RSCP_ENABLE_CHANGE_TRACKING
+    RSCP_COMMAND(RSCP_CMD_GET_CHANGES, 0, RSCP_DEF_REQUEST_MAX_LENGTH, RSCP_REPLY_DATA, rscpGetChanges)
+#endif
+#if RSCP_ENABLE_JOB_QUEUE
+    RSCP_COMMAND(RSCP_CMD_GET_JOB_STATUS, sizeof(struct RSCP_Arg_job_status),
+                 sizeof(struct RSCP_Arg_job_status), RSCP_REPLY_DATA, rscpGetJobStatus)
+    RSCP_COMMAND(RSCP_CMD_SUBMIT_JOB, 1, RSCP_MAX_DATA_LENGTH, RSCP_REPLY_DATA, rscpSubmitJob)
+#endif
+#if RSCP_ENABLE_FRAGMENTATION
+    RSCP_COMMAND(RSCP_CMD_FRAGMENT, sizeof(struct RSCP_Arg_fragment),
+                 RSCP_MAX_DATA_LENGTH, RSCP_REPLY_DATA, rscpHandleFragment)
+#endif
+};
+
+/**
+ * @brief Looks up a command in the command table and checks its argument.
+ *
+ * @param command The command byte.
+ * @param dataLength Length of the command argument.
+ * @param entry Filled with the table entry if the command is known.
+ * @return RSCP_ERR_OK, RSCP_ERR_NOT_SUPPORTED or RSCP_ERR_MALFORMED.
+ */
+static RSCP_ErrorType rscpFindCommand(uint8_t command, uint8_t dataLength, struct RSCP_command *entry) {
+    for (uint8_t i = 0; i < sizeof(rscpCommands) / sizeof(rscpCommands[0]); i++) {
+        rscpReadTableEntry(entry, &rscpCommands[i]);
+        if (entry->command != command) {
+            continue;
+        }
+        if ((dataLength < entry->minLength) || (dataLength > entry->maxLength)) {
+            return RSCP_ERR_MALFORMED;
+        }
+        return RSCP_ERR_OK;
     }
 
-    if ((err = rscpGetMsg(&frame, timeout_ticks)) != RSCP_ERR_OK) {
+    return RSCP_ERR_NOT_SUPPORTED;
+}
+
+/**
+ * @brief Runs an action command and returns its status.
+ *
+ * Commands that send their own reply cannot run as part of a batch. Queued
+ * actions only report whether they could be queued.
+ *
+ * @param command The action command byte.
+ * @param data Pointer to the action argument.
+ * @param dataLength Length of the action argument.
+ * @return RSCP error code to report to the master.
+ */
+RSCP_ErrorType rscpExecuteAction(uint8_t command, uint8_t *data, uint8_t dataLength) {
+    RSCP_ErrorType err;
+    struct RSCP_command entry;
+
+    if ((err = rscpFindCommand(command, dataLength, &entry)) != RSCP_ERR_OK) {
         return err;
     }
-
-    if (rscpGetCrcCallback(((uint8_t *)&frame), frame.length) != frame.crc) {
-        return RSCP_ERR_MALFORMED;
+    if (entry.replyType == RSCP_REPLY_DATA) {
+        return RSCP_ERR_NOT_SUPPORTED;
     }
-
-    if (frame.command != command) {
-        return RSCP_ERR_INVALID_ANSWER;
+#if RSCP_ENABLE_JOB_QUEUE
+    if (entry.replyType == RSCP_REPLY_JOB) {
+        uint8_t job;
+        return rscpJobSubmit(&entry, data, dataLength, &job);
     }
+#endif
 
-    return (RSCP_ErrorType)frame.data[0];
+    return entry.handler(data, dataLength);
 }
 
-#else
+#if RSCP_ENABLE_REPLAY_CACHE
 
 /**
- * @brief Sends a CPU query request to the master.
+ * @brief Tracks the newest sequence received and expires old cache entries.
  *
- * @return RSCP error code.
+ * A sequence less than RSCP_REPLAY_WINDOW behind the newest one is a retry
+ * and changes nothing. Any other sequence becomes the newest, which also
+ * follows a master that restarted its numbering, and the entries it leaves
+ * outside the window are dropped. They cannot be mistaken for a retry when
+ * the 8-bit sequence wraps around.
+ *
+ * @param sequence Sequence of the received frame.
  */
-RSCP_ErrorType rscpGetCPUQuery(void) {
-
-    // Fill reply
-    struct RSCP_Reply_cpuquery reply;
-    reply.flags = 0;
-    reply.crcType = RSCP_DEF_CRC_TYPE_MODBUS16;
-    reply.protocolversion = RSCP_DEF_PROTOCOL_VERSION;
-    reply.cpuType = RSCP_DEF_CPU_TYPE_ATMEGA328P_8MHZ;
-    reply.swversion = RSCP_DEF_SWVERSION_VERSION;
-    reply.packetMaxLen = sizeof(struct RSCP_frame);
+static void rscpReplaySeen(uint8_t sequence) {
+    if ((uint8_t)(rscpReplayNewest - sequence) < RSCP_REPLAY_WINDOW) {
+        return;
+    }
 
-    return rscpSendMsg(RSCP_CMD_CPU_QUERY, (uint8_t*)&reply, sizeof(struct RSCP_Reply_cpuquery));
+    rscpReplayNewest = sequence;
+    for (uint8_t i = 0; i < RSCP_REPLAY_CACHE_SIZE; i++) {
+        if ((uint8_t)(sequence - rscpReplays[i].sequence) >= RSCP_REPLAY_WINDOW) {
+            rscpReplays[i].valid = false;
+        }
+    }
 }
 
 /**
- * @brief Sends a shutter position request to the master.
+ * @brief Finds the cached reply of a request that was already executed.
  *
- * @return RSCP error code.
+ * @param frame Pointer to the received frame.
+ * @return Pointer to the cache entry, NULL if the request is new.
  */
-RSCP_ErrorType rscpGetShutterPosition(void) {
-
-    // Fill reply
-    struct RSCP_Reply_rollershutterposition reply;
-    rscpGetShutterPositionCallback(&reply);
+static const struct RSCP_replay * rscpReplayFind(const struct RSCP_frame *frame) {
+    for (uint8_t i = 0; i < RSCP_REPLAY_CACHE_SIZE; i++) {
+        const struct RSCP_replay *replay = &rscpReplays[i];
+        if (replay->valid && (replay->length != 0) && (replay->sequence == (uint8_t)frame->sequence) &&
+            (replay->command == frame->command) && (replay->crc == frame->crc)) {
+            return replay;
+        }
+    }
 
-    return rscpSendMsg(RSCP_CMD_GET_SHUTTER_POSITION, (uint8_t*)&reply, sizeof(struct RSCP_Reply_rollershutterposition));
+    return NULL;
 }
 
 /**
- * @brief Sends a switch relay request to the master.
+ * @brief Claims the oldest cache entry to record the reply of a request.
  *
- * @return RSCP error code.
+ * @param frame Pointer to the received frame.
+ * @return Pointer to the cache entry.
  */
-RSCP_ErrorType rscpGetSwitchRelay(void) {
+static struct RSCP_replay * rscpReplayClaim(const struct RSCP_frame *frame) {
+    struct RSCP_replay *replay = &rscpReplays[rscpReplayNext];
 
-    // Fill reply
-    struct RSCP_Reply_switchrelay reply;
-    rscpGetSwitchRelayCallback(&reply);
-    
-    return rscpSendMsg(RSCP_CMD_GET_SWITCH_RELAY, (uint8_t*)&reply, sizeof(struct RSCP_Reply_switchrelay));
+    rscpReplayNext = (rscpReplayNext + 1) % RSCP_REPLAY_CACHE_SIZE;
+    replay->valid = true;
+    replay->sequence = (uint8_t)frame->sequence;
+    replay->command = frame->command;
+    replay->crc = frame->crc;
+    replay->length = 0;
+
+    return replay;
 }
 
+#endif
+
 /**
- * @brief Sends a switch button request to the master.
+ * @brief Runs a command found in the command table and replies to it.
  *
+ * @param frame Pointer to the received frame.
+ * @param entry Pointer to the command table entry->
  * @return RSCP error code.
  */
-RSCP_ErrorType rscpGetSwitchButton(void) {
+static RSCP_ErrorType rscpDispatchCommand(struct RSCP_frame *frame, const struct RSCP_command *entry) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
 
-    // Fill reply
-    struct RSCP_Reply_switchbutton reply;
-    rscpGetSwitchButtonCallback(&reply);
-    
-    return rscpSendMsg(RSCP_CMD_GET_SWITCH_BUTTON, (uint8_t*)&reply, sizeof(struct RSCP_Reply_switchbutton));
+#if RSCP_ENABLE_JOB_QUEUE
+    if (entry->replyType == RSCP_REPLY_JOB) {
+        // Acknowledged with a status byte, only RSCP_CMD_SUBMIT_JOB returns the job ID
+        uint8_t job;
+        return rscpSendFail(frame->command, rscpJobSubmit(entry, &frame->data[0], frame->length - 2, &job));
+    }
+#endif
+    err = entry->handler(&frame->data[0], frame->length - 2);
+    if (entry->replyType == RSCP_REPLY_DATA) {
+        return err;
+    }
+
+    return rscpSendFail(frame->command, err);
 }
 
 /**
- * @brief Sends an answer to the master.
+ * @brief Runs a received command and sends or stages its reply.
  *
- * @param command The command byte to respond to.
- * @param errorCode The error code to send.
+ * @param frame Pointer to the received frame.
  * @return RSCP error code.
  */
-RSCP_ErrorType rscpSendFail(uint8_t command, uint8_t errorCode) {
+static RSCP_ErrorType rscpDispatch(struct RSCP_frame *frame) {
+    RSCP_ErrorType err = RSCP_ERR_OK;
+    struct RSCP_command entry;
 
-    // Fill reply
-    uint8_t data [] = { errorCode };
-    
-    return rscpSendMsg(command, (uint8_t*)&data, sizeof(data));
+#if RSCP_ENABLE_SEQUENCE
+    rscpTxSequence = frame->sequence; // The reply echoes the sequence of the request
+#endif
+
+#if RSCP_ENABLE_REPLAY_CACHE
+    if (frame->sequence != RSCP_NO_SEQUENCE) {
+        rscpReplaySeen((uint8_t)frame->sequence);
+    }
+#endif
+
+    if ((err = rscpFindCommand(frame->command, frame->length - 2, &entry)) == RSCP_ERR_OK) {
+#if RSCP_ENABLE_REPLAY_CACHE
+        // Actions and batches are not idempotent, their retries get the first reply
+        if ((frame->sequence != RSCP_NO_SEQUENCE) &&
+            ((entry.replyType != RSCP_REPLY_DATA) || (frame->command == RSCP_CMD_BATCH) ||
+             (frame->command == RSCP_CMD_SUBMIT_JOB))) {
+            const struct RSCP_replay *replay = rscpReplayFind(frame);
+            if (replay != NULL) {
+                return rscpSendFrame(replay->frame, replay->length);
+            }
+            rscpReplayRecord = rscpReplayClaim(frame);
+            err = rscpDispatchCommand(frame, &entry);
+            rscpReplayRecord = NULL;
+            return err;
+        }
+#endif
+        return rscpDispatchCommand(frame, &entry);
+    }
+
+    return rscpSendFail(frame->command, err);
 }
 
 /**
@@ -299,43 +3645,64 @@ RSCP_ErrorType rscpSendFail(uint8_t command, uint8_t errorCode) {
  */
 RSCP_ErrorType rscpHandle(uint32_t timeout_ticks) {
     RSCP_ErrorType err = RSCP_ERR_OK;
-    struct RSCP_frame frame;
+    rscpDeclareFrame(frame);
 
-    if ((err = rscpGetMsg(&frame, timeout_ticks)) != RSCP_ERR_OK) {
+    if ((err = rscpGetMsg(frame, timeout_ticks)) != RSCP_ERR_OK) {
         return err;
     }
 
-    if (rscpGetCrcCallback(((uint8_t *)&frame), frame.length) != frame.crc) {
-        return RSCP_ERR_MALFORMED;
-    }
+    return rscpDispatch(frame);
+}
 
-    switch (frame.command) {
-        case RSCP_CMD_CPU_QUERY:
-            return rscpGetCPUQuery();
-        case RSCP_CMD_GET_SHUTTER_POSITION:
-            return rscpGetShutterPosition();
-        case RSCP_CMD_GET_SWITCH_RELAY:
-            return rscpGetSwitchRelay();
-        case RSCP_CMD_GET_SWITCH_BUTTON:
-            return rscpGetSwitchButton();
-        case RSCP_CMD_SET_SHUTTER_ACTION:
-            err = rscpSetShutterActionCallback((struct RSCP_Arg_rollershutter *)&frame.data[0]);
-            break;
-        case RSCP_CMD_SET_SHUTTER_POSITION:
-            err = rscpSetShutterPositionCallback((struct RSCP_Arg_rollershutterposition *)&frame.data[0]);
-            break;
-        case RSCP_CMD_SET_SWITCH_RELAY:
-            err = rscpSetSwitchRelayCallback((struct RSCP_Arg_switchrelay *)&frame.data[0]);
-            break;
-        case RSCP_CMD_SET_BUZZER_ACTION:
-            err = rscpSetBuzzerActionCallback((struct RSCP_Arg_buzzer_action *)&frame.data[0]);
-            break;
-        default:
-            err = RSCP_ERR_NOT_SUPPORTED;
+#if RSCP_ENABLE_EVENT_DRIVEN
+
+/**
+ * @brief Takes bytes written by the master, e.g. from Wire's onReceive.
+ *
+ * Never blocks. Partial frames are kept until the next call, and every
+ * complete frame is handled at once, staging its reply for rscpOnRequest.
+ * Commands and their callbacks therefore run in the caller's context.
+ *
+ * @param bytes Pointer to the received bytes.
+ * @param length Number of received bytes.
+ */
+void rscpOnReceive(const uint8_t *bytes, uint32_t length) {
+    uint32_t consumed;
+
+    while (length > 0) {
+        RSCP_ParseStatus status = rscpParserFeed(&rscpRxParser, bytes, length, &consumed);
+        bytes += consumed;
+        length -= consumed;
+        if (status == RSCP_PARSE_FRAME_READY) {
+            rscpDispatch(&rscpRxParser.frame);
+        } else if ((status == RSCP_PARSE_NEED_MORE) || (consumed == 0)) {
             break;
+        }
+        // A corrupted frame is dropped without reply, the master times out
+    }
+}
+
+/**
+ * @brief Copies the staged reply for a master read, e.g. from Wire's onRequest.
+ *
+ * A reply larger than maxLength is handed out over several reads.
+ *
+ * @param out Buffer to fill.
+ * @param maxLength Size of the buffer.
+ * @return Number of bytes copied, 0 if no reply is staged.
+ */
+uint8_t rscpOnRequest(uint8_t *out, uint8_t maxLength) {
+    uint8_t length = rscpStagedLength - rscpStagedIndex;
+
+    if (length > maxLength) {
+        length = maxLength;
     }
+    memcpy(out, &rscpStagedFrame[rscpStagedIndex], length);
+    rscpStagedIndex += length;
 
-    return rscpSendFail(frame.command, err);
+    return length;
 }
 
 #endif
+
+#endif
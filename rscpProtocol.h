@@ -22,10 +22,483 @@
 #error RSCP_DEVICE_IS_MASTER must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
 #endif
 
-#define RSCP_MAX_TX_BUFFER_SIZE                                             (64)
+// Set to 1 when the host provides rscpGetRxBytesCallback(buffer, maxLength),
+// which hands over all received bytes at once instead of one per call.
+#ifndef RSCP_USE_RX_BYTES_CALLBACK
+#define RSCP_USE_RX_BYTES_CALLBACK                                           (0)
+#endif
+
+#if (RSCP_USE_RX_BYTES_CALLBACK != 0 && RSCP_USE_RX_BYTES_CALLBACK != 1)
+#error RSCP_USE_RX_BYTES_CALLBACK must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Size of the chunk requested from rscpGetRxBytesCallback
+#ifndef RSCP_RX_CHUNK_SIZE
+#define RSCP_RX_CHUNK_SIZE                                                  (32)
+#endif
+
+#if (RSCP_RX_CHUNK_SIZE < 1 || RSCP_RX_CHUNK_SIZE > 255)
+#error RSCP_RX_CHUNK_SIZE must be between 1 and 255
+#endif
+
+// Set to 1 when the host provides rscpGetTimeCallback(), a free running
+// clock (e.g. milliseconds). Timeouts are then measured with it and are
+// deadlines for the whole frame or transaction, instead of a count of polls
+// that restarts with every received byte.
+#ifndef RSCP_USE_TIME_CALLBACK
+#define RSCP_USE_TIME_CALLBACK                                               (0)
+#endif
+
+#if (RSCP_USE_TIME_CALLBACK != 0 && RSCP_USE_TIME_CALLBACK != 1)
+#error RSCP_USE_TIME_CALLBACK must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// CRC-16/MODBUS implementation used by the library
+#define RSCP_CRC_IMPL_CALLBACK                                               (0) // Host provides rscpGetCrcCallback
+#define RSCP_CRC_IMPL_BITWISE                                                (1) // No tables, 8 iterations per byte
+#define RSCP_CRC_IMPL_NIBBLE                                                 (2) // 32 byte table, 2 lookups per byte
+#define RSCP_CRC_IMPL_TABLE                                                  (3) // 512 byte table (PROGMEM on AVR)
+#define RSCP_CRC_IMPL_SLICE_BY_8                                             (4) // 4 KiB of tables, 8 bytes per iteration
+
+#ifndef RSCP_CRC_IMPL
+#define RSCP_CRC_IMPL                                   (RSCP_CRC_IMPL_CALLBACK)
+#endif
+
+#if (RSCP_CRC_IMPL < RSCP_CRC_IMPL_CALLBACK || RSCP_CRC_IMPL > RSCP_CRC_IMPL_SLICE_BY_8)
+#error RSCP_CRC_IMPL must be one of the RSCP_CRC_IMPL_* values
+#endif
+
+// Set to 1 to resynchronise on the next preamble byte after a corrupted
+// frame instead of reporting an error. Requires frames to start with
+// RSCP_PREAMBLE_BYTE.
+#ifndef RSCP_ENABLE_RESYNC
+#define RSCP_ENABLE_RESYNC                                                   (0)
+#endif
+
+#if (RSCP_ENABLE_RESYNC != 0 && RSCP_ENABLE_RESYNC != 1)
+#error RSCP_ENABLE_RESYNC must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Set to 1 when the slave host provides rscpGetAllStateCallback(reply).
+// Otherwise RSCP_CMD_GET_ALL_STATE is answered from the single GET callbacks.
+#ifndef RSCP_USE_ALL_STATE_CALLBACK
+#define RSCP_USE_ALL_STATE_CALLBACK                                          (0)
+#endif
+
+#if (RSCP_USE_ALL_STATE_CALLBACK != 0 && RSCP_USE_ALL_STATE_CALLBACK != 1)
+#error RSCP_USE_ALL_STATE_CALLBACK must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Set to 1 when the slave host provides
+// rscpSetShutterGroupActionCallback(arg) to start several shutters at once.
+// Otherwise RSCP_CMD_SET_SHUTTER_GROUP_ACTION calls
+// rscpSetShutterActionCallback once per selected shutter.
+#ifndef RSCP_USE_GROUP_ACTION_CALLBACK
+#define RSCP_USE_GROUP_ACTION_CALLBACK                                       (0)
+#endif
+
+#if (RSCP_USE_GROUP_ACTION_CALLBACK != 0 && RSCP_USE_GROUP_ACTION_CALLBACK != 1)
+#error RSCP_USE_GROUP_ACTION_CALLBACK must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Set to 1 when the slave host provides
+// rscpSetShutterPositionsCallback(positions, count) to take a whole
+// RSCP_CMD_SET_SHUTTER_POSITIONS array. Otherwise the command calls
+// rscpSetShutterPositionCallback once per entry.
+#ifndef RSCP_USE_MULTI_POSITION_CALLBACK
+#define RSCP_USE_MULTI_POSITION_CALLBACK                                     (0)
+#endif
+
+#if (RSCP_USE_MULTI_POSITION_CALLBACK != 0 && RSCP_USE_MULTI_POSITION_CALLBACK != 1)
+#error RSCP_USE_MULTI_POSITION_CALLBACK must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Built-in slave commands. Set one to 0 to drop its handler from the command
+// table, so its host callbacks are no longer needed unless another enabled
+// command uses them. RSCP_CMD_CPU_QUERY is always handled.
+#ifndef RSCP_ENABLE_CMD_SET_SHUTTER_ACTION
+#define RSCP_ENABLE_CMD_SET_SHUTTER_ACTION                                   (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_SET_SHUTTER_ACTION != 0 && RSCP_ENABLE_CMD_SET_SHUTTER_ACTION != 1)
+#error RSCP_ENABLE_CMD_SET_SHUTTER_ACTION must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#ifndef RSCP_ENABLE_CMD_SET_SHUTTER_GROUP_ACTION
+#define RSCP_ENABLE_CMD_SET_SHUTTER_GROUP_ACTION                             (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_SET_SHUTTER_GROUP_ACTION != 0 && RSCP_ENABLE_CMD_SET_SHUTTER_GROUP_ACTION != 1)
+#error RSCP_ENABLE_CMD_SET_SHUTTER_GROUP_ACTION must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#ifndef RSCP_ENABLE_CMD_SET_SHUTTER_POSITION
+#define RSCP_ENABLE_CMD_SET_SHUTTER_POSITION                                 (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_SET_SHUTTER_POSITION != 0 && RSCP_ENABLE_CMD_SET_SHUTTER_POSITION != 1)
+#error RSCP_ENABLE_CMD_SET_SHUTTER_POSITION must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#ifndef RSCP_ENABLE_CMD_SET_SHUTTER_POSITIONS
+#define RSCP_ENABLE_CMD_SET_SHUTTER_POSITIONS                                (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_SET_SHUTTER_POSITIONS != 0 && RSCP_ENABLE_CMD_SET_SHUTTER_POSITIONS != 1)
+#error RSCP_ENABLE_CMD_SET_SHUTTER_POSITIONS must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#ifndef RSCP_ENABLE_CMD_GET_SHUTTER_POSITION
+#define RSCP_ENABLE_CMD_GET_SHUTTER_POSITION                                 (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_GET_SHUTTER_POSITION != 0 && RSCP_ENABLE_CMD_GET_SHUTTER_POSITION != 1)
+#error RSCP_ENABLE_CMD_GET_SHUTTER_POSITION must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#ifndef RSCP_ENABLE_CMD_SET_SWITCH_RELAY
+#define RSCP_ENABLE_CMD_SET_SWITCH_RELAY                                     (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_SET_SWITCH_RELAY != 0 && RSCP_ENABLE_CMD_SET_SWITCH_RELAY != 1)
+#error RSCP_ENABLE_CMD_SET_SWITCH_RELAY must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#ifndef RSCP_ENABLE_CMD_GET_SWITCH_RELAY
+#define RSCP_ENABLE_CMD_GET_SWITCH_RELAY                                     (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_GET_SWITCH_RELAY != 0 && RSCP_ENABLE_CMD_GET_SWITCH_RELAY != 1)
+#error RSCP_ENABLE_CMD_GET_SWITCH_RELAY must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#ifndef RSCP_ENABLE_CMD_GET_SWITCH_BUTTON
+#define RSCP_ENABLE_CMD_GET_SWITCH_BUTTON                                    (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_GET_SWITCH_BUTTON != 0 && RSCP_ENABLE_CMD_GET_SWITCH_BUTTON != 1)
+#error RSCP_ENABLE_CMD_GET_SWITCH_BUTTON must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#ifndef RSCP_ENABLE_CMD_SET_BUZZER_ACTION
+#define RSCP_ENABLE_CMD_SET_BUZZER_ACTION                                    (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_SET_BUZZER_ACTION != 0 && RSCP_ENABLE_CMD_SET_BUZZER_ACTION != 1)
+#error RSCP_ENABLE_CMD_SET_BUZZER_ACTION must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#ifndef RSCP_ENABLE_CMD_BATCH
+#define RSCP_ENABLE_CMD_BATCH                                                (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_BATCH != 0 && RSCP_ENABLE_CMD_BATCH != 1)
+#error RSCP_ENABLE_CMD_BATCH must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#ifndef RSCP_ENABLE_CMD_GET_ALL_STATE
+#define RSCP_ENABLE_CMD_GET_ALL_STATE                                        (1)
+#endif
+
+#if (RSCP_ENABLE_CMD_GET_ALL_STATE != 0 && RSCP_ENABLE_CMD_GET_ALL_STATE != 1)
+#error RSCP_ENABLE_CMD_GET_ALL_STATE must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Host-defined slave commands, as a list of RSCP_COMMAND(...) entries. They
+// are looked up before the built-in ones, so an entry can also replace a
+// built-in command.
+#ifndef RSCP_HOST_COMMAND_TABLE
+#define RSCP_HOST_COMMAND_TABLE
+#endif
+
+// Set to 1 to let the slave track which state changed since the master last
+// read it (RSCP_CMD_GET_CHANGES). The host then provides
+// rscpAttentionCallback(asserted) to signal the master, e.g. with a GPIO.
+#ifndef RSCP_ENABLE_CHANGE_TRACKING
+#define RSCP_ENABLE_CHANGE_TRACKING                                          (0)
+#endif
+
+#if (RSCP_ENABLE_CHANGE_TRACKING != 0 && RSCP_ENABLE_CHANGE_TRACKING != 1)
+#error RSCP_ENABLE_CHANGE_TRACKING must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Set to 1 on a master that talks to several slaves. The host then provides
+// rscpSelectSlaveCallback(address), called before every transaction.
+#ifndef RSCP_ENABLE_MULTI_SLAVE
+#define RSCP_ENABLE_MULTI_SLAVE                                              (0)
+#endif
+
+#if (RSCP_ENABLE_MULTI_SLAVE != 0 && RSCP_ENABLE_MULTI_SLAVE != 1)
+#error RSCP_ENABLE_MULTI_SLAVE must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Number of slaves that can be registered on the master
+#ifndef RSCP_MAX_SLAVES
+#define RSCP_MAX_SLAVES                                                      (8)
+#endif
+
+#if (RSCP_MAX_SLAVES < 1 || RSCP_MAX_SLAVES > 127)
+#error RSCP_MAX_SLAVES must be between 1 and 127
+#endif
+
+// Upper bound of the polls a failing slave is skipped by the scheduler
+#ifndef RSCP_SLAVE_MAX_HOLDOFF
+#define RSCP_SLAVE_MAX_HOLDOFF                                            (1024)
+#endif
+
+// Set to 1 to let frames carry a sequence byte (protocol version 2), so the
+// master can keep several requests in flight and match replies by ID. The
+// master only uses it with slaves that reported version 2 in
+// RSCP_CMD_CPU_QUERY. Requires a built-in RSCP_CRC_IMPL.
+#ifndef RSCP_ENABLE_SEQUENCE
+#define RSCP_ENABLE_SEQUENCE                                                 (0)
+#endif
+
+#if (RSCP_ENABLE_SEQUENCE != 0 && RSCP_ENABLE_SEQUENCE != 1)
+#error RSCP_ENABLE_SEQUENCE must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#if RSCP_ENABLE_SEQUENCE && (RSCP_CRC_IMPL == RSCP_CRC_IMPL_CALLBACK)
+#error RSCP_ENABLE_SEQUENCE requires a built-in RSCP_CRC_IMPL, the sequence byte is not part of struct RSCP_frame data
+#endif
+
+// Requests the master keeps in flight at once with RSCP_ENABLE_SEQUENCE
+#ifndef RSCP_MAX_IN_FLIGHT
+#define RSCP_MAX_IN_FLIGHT                                                   (4)
+#endif
+
+#if (RSCP_MAX_IN_FLIGHT < 1 || RSCP_MAX_IN_FLIGHT > 16)
+#error RSCP_MAX_IN_FLIGHT must be between 1 and 16
+#endif
+
+// Set to 1 to let the master learn the round-trip time of each command per
+// slave and derive timeouts from it, retrying with exponential backoff.
+// timeout_ticks then only bounds a single attempt.
+#ifndef RSCP_ENABLE_ADAPTIVE_TIMEOUT
+#define RSCP_ENABLE_ADAPTIVE_TIMEOUT                                         (0)
+#endif
+
+#if (RSCP_ENABLE_ADAPTIVE_TIMEOUT != 0 && RSCP_ENABLE_ADAPTIVE_TIMEOUT != 1)
+#error RSCP_ENABLE_ADAPTIVE_TIMEOUT must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Commands below this value get their own round-trip estimate, the rest share the last one
+#ifndef RSCP_RTT_COMMANDS
+#define RSCP_RTT_COMMANDS                                                   (16)
+#endif
+
+#if (RSCP_RTT_COMMANDS < 1 || RSCP_RTT_COMMANDS > 256)
+#error RSCP_RTT_COMMANDS must be between 1 and 256
+#endif
+
+// Lower bound of an adaptive timeout, in ticks
+#ifndef RSCP_RTO_MIN
+#define RSCP_RTO_MIN                                                         (2)
+#endif
+
+// Attempts made after the first one times out with RSCP_ENABLE_ADAPTIVE_TIMEOUT
+#ifndef RSCP_MAX_RETRIES
+#define RSCP_MAX_RETRIES                                                     (2)
+#endif
+
+#if (RSCP_MAX_RETRIES < 0 || RSCP_MAX_RETRIES > 8)
+#error RSCP_MAX_RETRIES must be between 0 and 8
+#endif
+
+// Set to 1 to move payloads larger than one frame with RSCP_CMD_FRAGMENT.
+// The slave host then provides rscpFragmentWriteCallback(transfer, offset,
+// data, length) and rscpFragmentCompleteCallback(transfer, length).
+#ifndef RSCP_ENABLE_FRAGMENTATION
+#define RSCP_ENABLE_FRAGMENTATION                                            (0)
+#endif
+
+#if (RSCP_ENABLE_FRAGMENTATION != 0 && RSCP_ENABLE_FRAGMENTATION != 1)
+#error RSCP_ENABLE_FRAGMENTATION must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Fragments the master sends before waiting for an acknowledgement
+#ifndef RSCP_FRAGMENT_WINDOW
+#define RSCP_FRAGMENT_WINDOW                                                 (4)
+#endif
+
+#if (RSCP_FRAGMENT_WINDOW < 1 || RSCP_FRAGMENT_WINDOW > 8)
+#error RSCP_FRAGMENT_WINDOW must be between 1 and 8
+#endif
+
+// Acknowledgements the master may miss in a row before giving up a transfer
+#ifndef RSCP_FRAGMENT_MAX_RETRIES
+#define RSCP_FRAGMENT_MAX_RETRIES                                            (3)
+#endif
+
+// Set to 1 to let the slave acknowledge actions with a job ID right away and
+// run them later from rscpProcessJobs. Set it on the master as well to use
+// rscpSendActionJob and rscpRequestJobStatus.
+#ifndef RSCP_ENABLE_JOB_QUEUE
+#define RSCP_ENABLE_JOB_QUEUE                                                (0)
+#endif
+
+#if (RSCP_ENABLE_JOB_QUEUE != 0 && RSCP_ENABLE_JOB_QUEUE != 1)
+#error RSCP_ENABLE_JOB_QUEUE must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Jobs the slave keeps, queued or finished. Each holds a copy of its argument.
+#ifndef RSCP_JOB_QUEUE_SIZE
+#define RSCP_JOB_QUEUE_SIZE                                                  (4)
+#endif
+
+#if (RSCP_JOB_QUEUE_SIZE < 1 || RSCP_JOB_QUEUE_SIZE > 32)
+#error RSCP_JOB_QUEUE_SIZE must be between 1 and 32
+#endif
+
+// Set to 1 to keep the replies of RSCP_CMD_GET_SHUTTER_POSITION,
+// RSCP_CMD_GET_SWITCH_RELAY and RSCP_CMD_GET_SWITCH_BUTTON as ready-to-send
+// frames on the slave. They are rebuilt by rscpRefreshReplyCache(mask), and
+// sequenced requests get them with their sequence byte and CRC patched in.
+#ifndef RSCP_ENABLE_REPLY_CACHE
+#define RSCP_ENABLE_REPLY_CACHE                                              (0)
+#endif
+
+#if (RSCP_ENABLE_REPLY_CACHE != 0 && RSCP_ENABLE_REPLY_CACHE != 1)
+#error RSCP_ENABLE_REPLY_CACHE must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Set to 1 to drive the slave from the I2C receive and request events
+// (rscpOnReceive and rscpOnRequest) instead of polling with rscpHandle.
+// Replies are then staged for rscpOnRequest and rscpSendSlotCallback is
+// not used. Commands run inside rscpOnReceive, so every GET reply that is
+// not served by RSCP_ENABLE_REPLY_CACHE or RSCP_ENABLE_STATE_STORE calls
+// its GET callback from the interrupt.
+#ifndef RSCP_ENABLE_EVENT_DRIVEN
+#define RSCP_ENABLE_EVENT_DRIVEN                                             (0)
+#endif
+
+#if (RSCP_ENABLE_EVENT_DRIVEN != 0 && RSCP_ENABLE_EVENT_DRIVEN != 1)
+#error RSCP_ENABLE_EVENT_DRIVEN must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Critical section around the state that rscpOnReceive and the main loop
+// both update: the job queue and the dirty bits. Both are used as a pair in
+// one block and never nested, so the enter macro may declare a local, e.g.
+// uint8_t rscpSreg = SREG; cli(); with SREG = rscpSreg; as the exit on AVR.
+// The defaults are only compiler barriers, which is enough when rscpHandle is
+// used instead, and keeps the shared state from being cached in registers.
+#ifndef RSCP_ENTER_CRITICAL
+#define RSCP_ENTER_CRITICAL() RSCP_MEMORY_BARRIER()
+#endif
+
+#ifndef RSCP_EXIT_CRITICAL
+#define RSCP_EXIT_CRITICAL() RSCP_MEMORY_BARRIER()
+#endif
+
+// Set to 1 to keep the state reported by the GET commands in the library.
+// The application publishes it with rscpPublishState, and the GET callbacks
+// are no longer used. Readers never block the publisher, so the state can
+// be read from interrupts without disabling them.
+#ifndef RSCP_ENABLE_STATE_STORE
+#define RSCP_ENABLE_STATE_STORE                                              (0)
+#endif
+
+#if (RSCP_ENABLE_STATE_STORE != 0 && RSCP_ENABLE_STATE_STORE != 1)
+#error RSCP_ENABLE_STATE_STORE must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// Memory barrier of the state store. A compiler barrier is enough on single
+// core MCUs; use e.g. __sync_synchronize() when publisher and readers run on
+// different cores.
+#ifndef RSCP_MEMORY_BARRIER
+#define RSCP_MEMORY_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+// Set to 1 to let the slave answer a retried action from the reply it sent
+// the first time instead of running it again. Retries are recognised by
+// sequence, command and CRC, so it requires RSCP_ENABLE_SEQUENCE.
+#ifndef RSCP_ENABLE_REPLAY_CACHE
+#define RSCP_ENABLE_REPLAY_CACHE                                             (0)
+#endif
+
+#if (RSCP_ENABLE_REPLAY_CACHE != 0 && RSCP_ENABLE_REPLAY_CACHE != 1)
+#error RSCP_ENABLE_REPLAY_CACHE must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+#if (RSCP_ENABLE_REPLAY_CACHE == 1 && RSCP_ENABLE_SEQUENCE == 0)
+#error RSCP_ENABLE_REPLAY_CACHE requires RSCP_ENABLE_SEQUENCE
+#endif
+
+// Recently executed actions the slave remembers
+#ifndef RSCP_REPLAY_CACHE_SIZE
+#define RSCP_REPLAY_CACHE_SIZE                                               (4)
+#endif
+
+#if (RSCP_REPLAY_CACHE_SIZE < 1 || RSCP_REPLAY_CACHE_SIZE > 16)
+#error RSCP_REPLAY_CACHE_SIZE must be between 1 and 16
+#endif
+
+// Sequences a retry may lag behind the newest request. Older entries expire,
+// so an action that reuses their sequence after a wrap is executed again.
+#ifndef RSCP_REPLAY_WINDOW
+#define RSCP_REPLAY_WINDOW                                                  (16)
+#endif
+
+#if (RSCP_REPLAY_WINDOW < 1 || RSCP_REPLAY_WINDOW > 128)
+#error RSCP_REPLAY_WINDOW must be between 1 and 128
+#endif
+
+// Set to 1 to read received frames where the parser assembled them and to
+// build sent frames in one static buffer, instead of copying both onto the
+// stack of every call. A received frame is only valid until the next receive.
+#ifndef RSCP_ENABLE_STATIC_ARENA
+#define RSCP_ENABLE_STATIC_ARENA                                             (0)
+#endif
+
+#if (RSCP_ENABLE_STATIC_ARENA != 0 && RSCP_ENABLE_STATIC_ARENA != 1)
+#error RSCP_ENABLE_STATIC_ARENA must be set to 1 or 0 in moduleConfigs/rscpProtocolConfig.h
+#endif
+
+// CPU type reported by the slave in RSCP_CMD_CPU_QUERY
+#ifndef RSCP_CPU_TYPE
+#define RSCP_CPU_TYPE                        (RSCP_DEF_CPU_TYPE_ATMEGA328P_8MHZ)
+#endif
+
+// Number of transactions rscpSubmit can hold on the master
+#ifndef RSCP_TRANSACTION_QUEUE_SIZE
+#define RSCP_TRANSACTION_QUEUE_SIZE                                          (4)
+#endif
+
+#if (RSCP_TRANSACTION_QUEUE_SIZE < 1 || RSCP_TRANSACTION_QUEUE_SIZE > 255)
+#error RSCP_TRANSACTION_QUEUE_SIZE must be between 1 and 255
+#endif
+
+#if (RSCP_CRC_IMPL == RSCP_CRC_IMPL_SLICE_BY_8) && defined(__AVR__)
+#error RSCP_CRC_IMPL_SLICE_BY_8 is meant for 32-bit hosts, use RSCP_CRC_IMPL_TABLE or RSCP_CRC_IMPL_NIBBLE on AVR
+#endif
+
+// Data length every peer supports. The reason for this is that Wire library
+// only supports 32 bytes of data and therefore we need to limit the data to
+// 26 bytes (32 - Wire overhead (2 bytes) - length - command - crc (2 bytes)).
+#define RSCP_DEF_BASE_DATA_LENGTH                                           (26)
+
+// Largest data field this device sends or accepts. Larger frames are only
+// sent to peers that report room for them in RSCP_CMD_CPU_QUERY. The upper
+// bound keeps the length byte from ever matching RSCP_PREAMBLE_BYTE.
+#ifndef RSCP_MAX_DATA_LENGTH
+#define RSCP_MAX_DATA_LENGTH                         (RSCP_DEF_BASE_DATA_LENGTH)
+#endif
+
+#if (RSCP_MAX_DATA_LENGTH < RSCP_DEF_BASE_DATA_LENGTH || RSCP_MAX_DATA_LENGTH > 160)
+#error RSCP_MAX_DATA_LENGTH must be between RSCP_DEF_BASE_DATA_LENGTH and 160
+#endif
+
+#define RSCP_MAX_FRAME_WIRE_SIZE (1 + 2 + RSCP_ENABLE_SEQUENCE + RSCP_MAX_DATA_LENGTH + 2) // Preamble, length, command, [sequence,] data, crc
+#define RSCP_MAX_TX_BUFFER_SIZE                       (RSCP_MAX_FRAME_WIRE_SIZE)
 
 #define RSCP_PREAMBLE_BYTE                                                (0xAA)
 
+#define RSCP_CMD_FLAG_SEQUENCE                                            (0x80) // Set in the command byte when a sequence byte follows it
+#define RSCP_NO_SEQUENCE                                                    (-1)
+
+#define RSCP_CRC16_INIT                                                 (0xFFFF)
+#define RSCP_CRC16_POLY                                                 (0xA001) // Reflected 0x8005
+
 #define RSCP_CMD_FAIL                                                   (0x0001) // CMD failed. This is a lesser failure compared to NOK.
 #define RSCP_CMD_NOK                                                    (0x0002) // CMD not handled or parameter error. This is a fatal error.
 #define RSCP_CMD_CPU_QUERY                                              (0x0003) // Query CPU type and protocol version
@@ -36,13 +509,30 @@
 #define RSCP_CMD_GET_SWITCH_RELAY                                       (0x0008) // Get switch relay
 #define RSCP_CMD_SET_BUZZER_ACTION                                      (0x0009) // Set buzzer action
 #define RSCP_CMD_GET_SWITCH_BUTTON                                      (0x000A) // Get switch button
+#define RSCP_CMD_BATCH                                                  (0x000B) // Run several actions in one frame
+#define RSCP_CMD_GET_ALL_STATE                                          (0x000C) // Get shutters, relay and button at once
+#define RSCP_CMD_GET_CHANGES                                            (0x000D) // Get the state that changed since last read
+#define RSCP_CMD_FRAGMENT                                               (0x000E) // Part of a transfer larger than one frame
+#define RSCP_CMD_SET_SHUTTER_GROUP_ACTION                               (0x000F) // Set the same action on several shutters
+#define RSCP_CMD_SET_SHUTTER_POSITIONS                                  (0x0010) // Set the position of several shutters
+#define RSCP_CMD_GET_JOB_STATUS                                         (0x0011) // Get the state of a deferred action
+#define RSCP_CMD_SUBMIT_JOB                                             (0x0012) // Queue an action and get its job ID
+#define RSCP_CMD_HOST_FIRST                                             (0x0040) // First command ID free for host commands
+#define RSCP_CMD_HOST_LAST                                              (0x007F) // Last command ID free for host commands
 
 // RSCP_CMD_CPU_QUERY
-#define RSCP_DEF_PROTOCOL_VERSION                                         (0x01)
+#define RSCP_DEF_PROTOCOL_VERSION_BASE                                    (0x01) // Plain frames only
+#define RSCP_DEF_PROTOCOL_VERSION_SEQUENCE                                (0x02) // First version with sequence bytes
+#if RSCP_ENABLE_SEQUENCE
+#define RSCP_DEF_PROTOCOL_VERSION           (RSCP_DEF_PROTOCOL_VERSION_SEQUENCE)
+#else
+#define RSCP_DEF_PROTOCOL_VERSION               (RSCP_DEF_PROTOCOL_VERSION_BASE)
+#endif
 #define RSCP_DEF_SWVERSION_VERSION                                        (0x01)
 #define RSCP_DEF_CRC_TYPE_MODBUS16                                        (0x01)
 #define RSCP_DEF_CPU_TYPE_ATMEGA328P_8MHZ                                 (0x01)
 #define RSCP_DEF_CPU_TYPE_ESP32_WROOM_02D                                 (0x02)
+#define RSCP_DEF_PACKET_OVERHEAD                                             (4) // packetMaxLen counts length, command, data and crc
 
 // RSCP_CMD_SET_SHUTTER_ACTION
 #define RSCP_DEF_SHUTTER_ACTION_STOP                                      (0x01)
@@ -51,6 +541,24 @@
 #define RSCP_DEF_SHUTTER_ACTION_OPEN                                      (0x04)
 #define RSCP_DEF_SHUTTER_ACTION_CLOSE                                     (0x05)
 
+// RSCP_CMD_SET_SHUTTER_GROUP_ACTION
+// Takes the RSCP_DEF_SHUTTER_ACTION_* values. Bit n of the mask selects
+// shutter n, so one frame addresses up to RSCP_DEF_GROUP_MAX_SHUTTERS.
+#define RSCP_DEF_GROUP_MAX_SHUTTERS                                         (32)
+
+// RSCP_CMD_SET_SHUTTER_POSITIONS
+// The data is an array of struct RSCP_Arg_rollershutterposition, its length
+// gives the number of entries (13 with the base data length).
+#define RSCP_DEF_POSITIONS_MAX_SHUTTERS               (RSCP_MAX_DATA_LENGTH / 2)
+
+// RSCP_CMD_GET_JOB_STATUS, RSCP_CMD_SUBMIT_JOB
+// Plain actions are always answered with a single status byte. Wrapped in
+// RSCP_CMD_SUBMIT_JOB, they are answered with a struct RSCP_Reply_job.
+#define RSCP_DEF_JOB_NONE                                                 (0x00) // Never used as a job ID
+#define RSCP_DEF_JOB_STATE_UNKNOWN                                        (0x00) // No such job, or its result was overwritten
+#define RSCP_DEF_JOB_STATE_PENDING                                        (0x01)
+#define RSCP_DEF_JOB_STATE_DONE                                           (0x02)
+
 // RSCP_CMD_SWITCH_RELAY
 #define RSCP_DEF_SWITCH_RELAY_OFF                                         (0x01)
 #define RSCP_DEF_SWITCH_RELAY_ON                                          (0x02)
@@ -63,6 +571,32 @@
 #define RSCP_DEF_BUZZER_ACTION_ON                                         (0x01)
 #define RSCP_DEF_BUZZER_ACTION_OFF                                        (0x02)
 
+// RSCP_CMD_BATCH
+// Each sub-command is command (1 byte), argument length (1 byte), argument.
+// The reply carries one RSCP_ErrorType byte per sub-command, in order.
+#define RSCP_DEF_BATCH_HEADER_SIZE                                           (2)
+
+// RSCP_CMD_GET_ALL_STATE
+#define RSCP_DEF_ALL_STATE_RELAY_ON                                       (0x01) // Relay is RSCP_DEF_SWITCH_RELAY_ON
+#define RSCP_DEF_ALL_STATE_BUTTON_ON                                      (0x02) // Button is RSCP_DEF_SWITCH_BUTTON_ON
+#define RSCP_DEF_ALL_STATE_MAX_SHUTTERS         ((RSCP_MAX_DATA_LENGTH - 2) / 2)
+#define RSCP_DEF_ALL_STATE_BASE_SHUTTERS   ((RSCP_DEF_BASE_DATA_LENGTH - 2) / 2) // Sent when the master gives no limit
+
+// RSCP_CMD_GET_CHANGES
+#define RSCP_DEF_DIRTY_SHUTTER                                            (0x01)
+#define RSCP_DEF_DIRTY_RELAY                                              (0x02)
+#define RSCP_DEF_DIRTY_BUTTON                                             (0x04)
+#define RSCP_DEF_DIRTY_ALL (RSCP_DEF_DIRTY_SHUTTER | RSCP_DEF_DIRTY_RELAY | RSCP_DEF_DIRTY_BUTTON)
+#define RSCP_DEF_CHANGES_ACK                                              (0x80) // The request acknowledges the last reply
+
+// RSCP_CMD_FRAGMENT
+// Each fragment is a struct RSCP_Arg_fragment followed by up to chunkSize
+// bytes, stored at offset index * chunkSize. Only fragments flagged
+// RSCP_DEF_FRAGMENT_ACK_REQ are answered, with a struct RSCP_Reply_fragment_ack.
+#define RSCP_DEF_FRAGMENT_LAST                                            (0x01) // Last fragment of the transfer
+#define RSCP_DEF_FRAGMENT_ACK_REQ                                         (0x02) // Reply with the reception state
+#define RSCP_DEF_FRAGMENT_FIRST                                           (0x04) // First send of fragment 0, restarts reassembly
+
 typedef enum {
     RSCP_ERR_OK                 =  0,
     RSCP_ERR_TIMEOUT            = -1,
@@ -75,15 +609,39 @@ typedef enum {
     RSCP_ERR_INVALID_ANSWER     = -8,
 } RSCP_ErrorType;
 
+typedef enum {
+    RSCP_PARSE_NEED_MORE        =  0,
+    RSCP_PARSE_FRAME_READY      =  1,
+    RSCP_PARSE_ERROR            =  2,
+} RSCP_ParseStatus;
+
 struct RSCP_frame
 {
     uint8_t length; // Length without crc field
     uint8_t command;
-    // The reason for this is that Wire library only supports 32 bytes of data 
-    // and therefore we need to limit the data to 26 bytes 
-    // (32 - Wire overhead (2 bytes) - length - command - crc (2 bytes)) = 26 bytes)
-    uint8_t data[26];
+    // Only RSCP_DEF_BASE_DATA_LENGTH bytes unless the peer negotiated more
+    uint8_t data[RSCP_MAX_DATA_LENGTH];
     uint16_t crc;
+#if RSCP_ENABLE_SEQUENCE
+    int16_t sequence;   // RSCP_NO_SEQUENCE if the frame carried none
+#endif
+};
+
+// Persistent receive context. It survives between calls, so a frame that
+// arrives in several pieces (or across a timeout) is not lost.
+struct RSCP_parser
+{
+    struct RSCP_frame frame;    // Valid after RSCP_PARSE_FRAME_READY until the next feed
+    uint8_t state;
+    uint8_t dataIndex;
+    uint16_t crc;               // Running CRC of the bytes received so far
+    RSCP_ErrorType error;       // Valid after RSCP_PARSE_ERROR
+#if RSCP_ENABLE_RESYNC
+    uint8_t window[RSCP_MAX_FRAME_WIRE_SIZE]; // Raw bytes of the frame being parsed
+    uint8_t windowLength;
+    uint8_t replayIndex;        // Bytes window[replayIndex..replayLength) are rescanned
+    uint8_t replayLength;
+#endif
 };
 
 struct __attribute__ ((__packed__)) RSCP_Arg_rollershutter
@@ -93,6 +651,13 @@ struct __attribute__ ((__packed__)) RSCP_Arg_rollershutter
     uint8_t retries;
 };
 
+struct __attribute__ ((__packed__)) RSCP_Arg_rollershutter_group
+{
+    uint32_t shutterMask;   // Bit n selects shutter n
+    uint8_t action;
+    uint8_t retries;
+};
+
 struct __attribute__ ((__packed__)) RSCP_Arg_rollershutterposition
 {
     uint8_t shutter;
@@ -137,15 +702,226 @@ struct __attribute__ ((__packed__)) RSCP_Reply_switchbutton
     uint8_t status;
 };
 
+// Masters that send 0 get at most RSCP_DEF_ALL_STATE_BASE_SHUTTERS
+struct __attribute__ ((__packed__)) RSCP_Arg_allstate
+{
+    uint8_t maxShutters;    // Most shutters the master can receive
+};
+
+struct __attribute__ ((__packed__)) RSCP_Reply_allstate
+{
+    uint8_t flags;          // RSCP_DEF_ALL_STATE_* bits
+    uint8_t shutterCount;   // Valid entries in shutters, only those are sent
+    struct RSCP_Reply_rollershutterposition shutters[RSCP_DEF_ALL_STATE_MAX_SHUTTERS];
+};
+
+struct __attribute__ ((__packed__)) RSCP_Arg_fragment
+{
+    uint8_t transfer;       // Chosen by the master, the same for all fragments of a transfer
+    uint8_t flags;          // RSCP_DEF_FRAGMENT_* bits
+    uint8_t chunkSize;      // Payload size of every fragment but the last, never 0
+    uint16_t index;         // Fragment number
+};
+
+struct __attribute__ ((__packed__)) RSCP_Reply_fragment_ack
+{
+    uint8_t transfer;
+    uint16_t base;          // All fragments below this index were received
+    uint8_t bitmap;         // Bit i set if fragment base + i was received
+};
+
+struct __attribute__ ((__packed__)) RSCP_Reply_job
+{
+    uint8_t status;         // RSCP_ErrorType of the submission
+    uint8_t job;            // RSCP_DEF_JOB_NONE if the action was not queued
+};
+
+struct __attribute__ ((__packed__)) RSCP_Arg_job_status
+{
+    uint8_t job;
+};
+
+struct __attribute__ ((__packed__)) RSCP_Reply_job_status
+{
+    uint8_t job;
+    uint8_t state;          // RSCP_DEF_JOB_STATE_*
+    uint8_t result;         // RSCP_ErrorType returned by the action, once done
+};
+
+// Masters that do not set RSCP_DEF_CHANGES_ACK have their changes cleared
+// as soon as the reply is sent
+struct __attribute__ ((__packed__)) RSCP_Arg_changes
+{
+    uint8_t ack;            // RSCP_DEF_CHANGES_ACK | RSCP_DEF_DIRTY_* bits of the last reply received
+};
+
+// On the wire only the items flagged in dirty follow, in this order
+struct __attribute__ ((__packed__)) RSCP_Reply_changes
+{
+    uint8_t dirty;          // RSCP_DEF_DIRTY_* bits
+    struct RSCP_Reply_rollershutterposition shutter;
+    struct RSCP_Reply_switchrelay relay;
+    struct RSCP_Reply_switchbutton button;
+};
+
+uint16_t rscpCrc16Init(void);
+uint16_t rscpCrc16Update(uint16_t crc, const uint8_t *data, uint32_t length);
+uint16_t rscpCrc16Final(uint16_t crc);
+uint16_t rscpCrc16(const uint8_t *data, uint32_t length);
+
+void rscpParserInit(struct RSCP_parser *parser);
+RSCP_ParseStatus rscpParserFeed(struct RSCP_parser *parser, const uint8_t *bytes, uint32_t length, uint32_t *consumed);
+
 #if RSCP_DEVICE_IS_MASTER
 
 RSCP_ErrorType rscpRequestData(uint8_t command, uint8_t * data, uint8_t dataLength, uint32_t timeout_ticks);
 RSCP_ErrorType rscpSendAction(uint8_t command, uint8_t * data, uint8_t dataLength, uint32_t timeout_ticks);
 
+struct RSCP_batch
+{
+    uint8_t length;             // Bytes used in data
+    uint8_t count;              // Number of sub-commands
+    uint8_t data[RSCP_MAX_DATA_LENGTH];
+};
+
+void rscpBatchInit(struct RSCP_batch *batch);
+RSCP_ErrorType rscpBatchAdd(struct RSCP_batch *batch, uint8_t command, const uint8_t *data, uint8_t dataLength);
+RSCP_ErrorType rscpSendBatch(const struct RSCP_batch *batch, RSCP_ErrorType *results, uint32_t timeout_ticks);
+
+RSCP_ErrorType rscpRequestChanges(struct RSCP_Reply_changes *changes, uint32_t timeout_ticks);
+RSCP_ErrorType rscpRequestAllState(struct RSCP_Reply_allstate *state, uint32_t timeout_ticks);
+uint8_t rscpGetMaxDataLength(void);
+
+#if RSCP_ENABLE_FRAGMENTATION
+RSCP_ErrorType rscpSendFragmented(const uint8_t *data, uint32_t length, uint32_t timeout_ticks);
+#endif
+
+#if RSCP_ENABLE_JOB_QUEUE
+RSCP_ErrorType rscpSendActionJob(uint8_t command, uint8_t *data, uint8_t dataLength, uint8_t *job, uint32_t timeout_ticks);
+RSCP_ErrorType rscpRequestJobStatus(uint8_t job, struct RSCP_Reply_job_status *status, uint32_t timeout_ticks);
+#endif
+
+typedef enum {
+    RSCP_PRIORITY_LOW           =  0, // Data requests (polls)
+    RSCP_PRIORITY_NORMAL        =  1, // Actions
+    RSCP_PRIORITY_URGENT        =  2, // RSCP_DEF_SHUTTER_ACTION_STOP
+} RSCP_Priority;
+
+typedef void (*RSCP_CompletionCallback)(void *context, RSCP_ErrorType err);
+
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+
+// Round-trip estimate of one command, in ticks
+struct RSCP_rtt
+{
+    uint16_t srtt;              // Smoothed round-trip time, scaled by 8. 0 until measured
+    uint16_t rttvar;            // Mean deviation, scaled by 4
+};
+
+#endif
+
+RSCP_ErrorType rscpSubmit(uint8_t command, const uint8_t *data, uint8_t dataLength,
+                          uint8_t *reply, uint8_t replyLength, uint32_t timeout_ticks,
+                          RSCP_CompletionCallback callback, void *context);
+bool rscpPoll(void);
+
+#if RSCP_ENABLE_MULTI_SLAVE
+
+#define RSCP_SLAVE_FLAG_DISCOVERED                                        (0x01) // capabilities are valid
+#define RSCP_SLAVE_FLAG_BUSY                                              (0x02) // Skipped by the scheduler
+
+struct RSCP_slave
+{
+    uint8_t address;
+    uint8_t flags;              // RSCP_SLAVE_FLAG_*
+    uint8_t failures;           // Consecutive failed transactions
+    uint16_t holdoff;           // rscpPoll calls left before the slave is scheduled again
+    struct RSCP_Reply_cpuquery capabilities;
+    uint8_t maxDataLength;      // Negotiated from capabilities.packetMaxLen
+    uint8_t protocolVersion;    // Reported by the last RSCP_CMD_CPU_QUERY reply
+    uint8_t changesAck;         // RSCP_DEF_DIRTY_* bits to acknowledge with the next RSCP_CMD_GET_CHANGES
+#if RSCP_ENABLE_ADAPTIVE_TIMEOUT
+    struct RSCP_rtt rtt[RSCP_RTT_COMMANDS];
+#endif
+};
+
+struct RSCP_slave * rscpSlaveRegister(uint8_t address);
+RSCP_ErrorType rscpSlaveSelect(struct RSCP_slave *slave);
+RSCP_ErrorType rscpSlaveDiscover(struct RSCP_slave *slave, uint32_t timeout_ticks);
+void rscpSlaveSetBusy(struct RSCP_slave *slave, bool busy);
+RSCP_ErrorType rscpSubmitTo(struct RSCP_slave *slave, uint8_t command, const uint8_t *data, uint8_t dataLength,
+                            uint8_t *reply, uint8_t replyLength, uint32_t timeout_ticks,
+                            RSCP_CompletionCallback callback, void *context);
+
+#endif
+
 #else
 
+// Argument length of data requests, which carry one padding byte at most
+#define RSCP_DEF_REQUEST_MAX_LENGTH                                          (1)
+
+typedef enum {
+    RSCP_REPLY_STATUS           =  0, // The library replies with the handler's return value
+    RSCP_REPLY_DATA             =  1, // The handler sends its own reply
+    RSCP_REPLY_JOB              =  2, // Queued with RSCP_ENABLE_JOB_QUEUE, run like RSCP_REPLY_STATUS otherwise
+} RSCP_ReplyType;
+
+typedef RSCP_ErrorType (*RSCP_CommandHandler)(uint8_t *data, uint8_t dataLength);
+
+// Entry of the slave command table. The argument length is checked against
+// minLength and maxLength before the handler runs.
+struct RSCP_command
+{
+    uint8_t command;
+    uint8_t minLength;
+    uint8_t maxLength;
+    uint8_t replyType;          // RSCP_REPLY_*
+    RSCP_CommandHandler handler;
+};
+
+// Entry of RSCP_HOST_COMMAND_TABLE, e.g.
+// #define RSCP_HOST_COMMAND_TABLE RSCP_COMMAND(0x40, 1, 1, RSCP_REPLY_STATUS, myHandler)
+#define RSCP_COMMAND(command, minLength, maxLength, replyType, handler) \
+    { (command), (minLength), (maxLength), (replyType), (handler) },
+
+#if RSCP_ENABLE_STATE_STORE
+
+// State reported by the GET commands
+struct RSCP_state
+{
+    struct RSCP_Reply_rollershutterposition shutter;
+    struct RSCP_Reply_switchrelay relay;
+    struct RSCP_Reply_switchbutton button;
+};
+
+#endif
+
 RSCP_ErrorType rscpHandle(uint32_t timeout_ticks);
 
+#if RSCP_ENABLE_EVENT_DRIVEN
+void rscpOnReceive(const uint8_t *bytes, uint32_t length);
+uint8_t rscpOnRequest(uint8_t *out, uint8_t maxLength);
+#endif
+
+#if RSCP_ENABLE_JOB_QUEUE
+uint8_t rscpProcessJobs(void);
+#endif
+
+#if RSCP_ENABLE_STATE_STORE
+void rscpPublishState(const struct RSCP_state *state);
+void rscpReadState(struct RSCP_state *state);
+#endif
+
+#if RSCP_ENABLE_REPLY_CACHE
+void rscpRefreshReplyCache(uint8_t mask);
+bool rscpGetCachedReply(uint8_t command, const uint8_t **frame, uint8_t *length);
+#endif
+
+#if RSCP_ENABLE_CHANGE_TRACKING
+void rscpMarkDirty(uint8_t mask);
+void rscpPollStateChanges(void);
+#endif
+
 #endif
 
 #include "rscpProtocol.c"